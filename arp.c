@@ -2,19 +2,31 @@
 
 #include "arp.h"
 #include "network.h"
+#include "stack.h"
 #include "list.h"
 #include "time.h"
 #include "mac.h"
 #include "ip.h"
+#include "route.h"
 
 //--------------------------------------------------------------------------------------------------
 
-#define ARP_ENTRY_COUNT                8
 #define ARP_ENTRY_MAX_QUEUE_SIZE       2
 #define ARP_ENTRY_EXPIRATION_INTERVAL  60000
 
+// Time from the last reply until a mapping turns stale. Unused stale entries expire at
+// ARP_ENTRY_EXPIRATION_INTERVAL.
+#define ARP_REACHABLE_TIME  30000
+
 #define ARP_RETRY_INTERVAL   1000
 #define ARP_RETRY_MAX_COUNT  3
+#define ARP_PROBE_MAX_COUNT  3
+
+// How many of the least recently used entries are checked for one without queued packets when the
+// table is full.
+#define ARP_EVICTION_SCAN_COUNT  8
+
+#define ARP_TASK_INTERVAL  100
 
 #define HARDWARE_TYPE_ETHERNET  1
 
@@ -25,6 +37,7 @@ enum {
     ARP_TYPE_PROBE,
     ARP_TYPE_ANNOUNCEMENT,
     ARP_TYPE_REQUEST,
+    ARP_TYPE_UNICAST_REQUEST,
     ARP_TYPE_REPLY,
 };
 
@@ -47,38 +60,36 @@ typedef struct PACKED {
     Ip  target_ip;
 } ArpHeader;
 
-typedef struct {
-    Mac      mac;
-    Ip       ip;
-    bool     contain_valid_mapping;
-    Time     time;
-    int      retry_count;
-    List     packet_queue;
-    int      packet_count;
-    ListNode list_node;
-} ArpEntry;
-
 //--------------------------------------------------------------------------------------------------
 
-static ArpEntry arp_entries[ARP_ENTRY_COUNT];
-static List free_entries;
-static List used_entries;
+void arp_init(NetworkStack* stack) {
+    Arp* arp = &stack->arp;
 
-//--------------------------------------------------------------------------------------------------
+    list_init(&arp->free_entries);
+    list_init(&arp->used_entries);
+    arp->generation = 0;
+    arp->task_time = get_time();
 
-void arp_init() {
-    list_init(&free_entries);
-    list_init(&used_entries);
+    for (int i = 0; i < ARP_BUCKET_COUNT; i++) {
+        list_init(&arp->buckets[i]);
+    }
 
     for (int i = 0; i < ARP_ENTRY_COUNT; i++) {
-        list_init(&arp_entries[i].packet_queue);
-        list_add_first(&arp_entries[i].list_node, &free_entries);
+        list_init(&arp->entries[i].packet_queue);
+        list_add_first(&arp->entries[i].list_node, &arp->free_entries);
     }
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static void free_entry(ArpEntry* entry) {
+// Fibonacci hashing. Hosts on the same subnet only differ in the low bits.
+static List* get_bucket(NetworkStack* stack, Ip ip) {
+    return &stack->arp.buckets[(u32)(ip * 2654435761u) >> (32 - ARP_BUCKET_BITS)];
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void free_entry(NetworkStack* stack, ArpEntry* entry) {
     // Delete any pending packets before freing the entry.
     while (1) {
         ListNode* node = list_remove_first(&entry->packet_queue);
@@ -88,60 +99,97 @@ static void free_entry(ArpEntry* entry) {
         }
 
         NetworkPacket* packet = get_struct_containing_list_node(node, NetworkPacket, list_node);
-        free_network_packet(packet);
+        free_network_packet(stack, packet);
         entry->packet_count--;
     }
 
+    if (entry->state != ARP_STATE_INCOMPLETE) {
+        stack->arp.generation++;
+    }
+
+    list_remove(&entry->bucket_node);
     list_remove(&entry->list_node);
-    list_add_first(&entry->list_node, &free_entries);
+    list_add_first(&entry->list_node, &stack->arp.free_entries);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static ArpEntry* allocate_entry() {
-    ListNode* node = list_remove_first(&free_entries);
+// When the table is full, the least recently used entry is reused. Entries with queued packets are
+// still being resolved for someone, so an idle entry among the oldest few is preferred.
+static ArpEntry* evict_entry(NetworkStack* stack) {
+    ListNode* victim = list_get_first(&stack->arp.used_entries);
+    int scanned = 0;
 
-    // Handle cases where no free ARP entries are avaliable.
-    if (node == 0) {
-        ListNode* used_node = list_get_first(&used_entries);
-        ArpEntry* entry = get_struct_containing_list_node(used_node, ArpEntry, list_node);
+    list_iterate(it, &stack->arp.used_entries) {
+        if (scanned++ == ARP_EVICTION_SCAN_COUNT) {
+            break;
+        }
 
-        free_entry(entry);
-        node = &entry->list_node;
+        if (get_struct_containing_list_node(it, ArpEntry, list_node)->packet_count == 0) {
+            victim = it;
+            break;
+        }
     }
 
-    ArpEntry* entry = get_struct_containing_list_node(node, ArpEntry, list_node);
+    ArpEntry* entry = get_struct_containing_list_node(victim, ArpEntry, list_node);
+    free_entry(stack, entry);
+    return entry;
+}
+
+//--------------------------------------------------------------------------------------------------
 
-    entry->contain_valid_mapping = false;
+static ArpEntry* allocate_entry(NetworkStack* stack, Ip ip) {
+    ListNode* node = list_remove_first(&stack->arp.free_entries);
+    ArpEntry* entry;
+
+    if (node) {
+        entry = get_struct_containing_list_node(node, ArpEntry, list_node);
+    }
+    else {
+        entry = evict_entry(stack);
+        list_remove(&entry->list_node);
+    }
+
+    entry->ip = ip;
+    entry->state = ARP_STATE_INCOMPLETE;
     entry->retry_count = 0;
     entry->packet_count = 0;
 
-    list_add_last(&entry->list_node, &used_entries);
+    list_add_last(&entry->list_node, &stack->arp.used_entries);
+    list_add_first(&entry->bucket_node, get_bucket(stack, ip));
     return entry;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-// The target_mac is only needed for ARP reply. The target_ip is not needed for ARP announcement or 
-// gratuitous ARP. 
-static void send_arp_packet(Mac* target_mac, Ip target_ip, int arp_type) {
-    NetworkPacket* packet = allocate_network_packet();
+// The target_mac is only needed for ARP reply and unicast request. The target_ip is not needed for ARP
+// announcement or gratuitous ARP.
+static void send_arp_packet(NetworkStack* stack, Mac* target_mac, Ip target_ip, int arp_type) {
+    NetworkPacket* packet = allocate_reserved_network_packet(stack, sizeof(ArpHeader));
+
+    if (packet == 0) {
+        return;
+    }
 
     ArpHeader* header = (ArpHeader *)&packet->data[packet->index];
     packet->length = sizeof(ArpHeader);
 
-    if (arp_type != ARP_TYPE_REPLY) {
-        target_mac = &(Mac){ .address = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } };
+    const Mac zero_mac = { .address = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } };
+
+    bool unicast = arp_type == ARP_TYPE_REPLY || arp_type == ARP_TYPE_UNICAST_REQUEST;
+
+    if (unicast == false) {
+        target_mac = (Mac *)&zero_mac;
     }
 
     if (arp_type == ARP_TYPE_ANNOUNCEMENT || arp_type == ARP_TYPE_GRATUITOUS) {
-        target_ip = get_our_ip();
+        target_ip = get_our_ip(stack);
     }
 
-    Ip senders_ip = (arp_type == ARP_TYPE_PROBE) ? 0 : get_our_ip();
+    Ip senders_ip = (arp_type == ARP_TYPE_PROBE) ? 0 : get_our_ip(stack);
     u16 operation = (arp_type == ARP_TYPE_GRATUITOUS || arp_type == ARP_TYPE_REPLY) ? ARP_OPERATION_REPLY : ARP_OPERATION_REQUEST;
 
-    memory_copy(get_our_mac(), &header->senders_mac, sizeof(Mac));
+    memory_copy(get_our_mac(stack), &header->senders_mac, sizeof(Mac));
     memory_copy(target_mac, &header->target_mac, sizeof(Mac));
 
     header->hardware_length = sizeof(Mac);
@@ -153,19 +201,26 @@ static void send_arp_packet(Mac* target_mac, Ip target_ip, int arp_type) {
     write_be32(senders_ip, &header->senders_ip);
     write_be32(target_ip, &header->target_ip);
 
-    if (arp_type == ARP_TYPE_REPLY) {
-        mac_send(packet, target_mac, ETHER_TYPE_ARP);
+    bool sent;
+
+    if (unicast) {
+        sent = mac_send(stack, packet, target_mac, ETHER_TYPE_ARP);
     }
     else {
-        mac_broadcast(packet, ETHER_TYPE_ARP);
+        sent = mac_broadcast(stack, packet, ETHER_TYPE_ARP);
+    }
+
+    // The TX ring is full. Requests are retried by arp_task, and the peer will ask again.
+    if (sent == false) {
+        free_network_packet(stack, packet);
     }
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static ArpEntry* find_arp_entry(Ip ip) {
-    list_iterate(it, &used_entries) {
-        ArpEntry* entry = get_struct_containing_list_node(it, ArpEntry, list_node);
+static ArpEntry* find_arp_entry(NetworkStack* stack, Ip ip) {
+    list_iterate(it, get_bucket(stack, ip)) {
+        ArpEntry* entry = get_struct_containing_list_node(it, ArpEntry, bucket_node);
 
         if (entry->ip == ip) {
             return entry;
@@ -177,13 +232,36 @@ static ArpEntry* find_arp_entry(Ip ip) {
 
 //--------------------------------------------------------------------------------------------------
 
-static void add_to_arp_entry_queue(NetworkPacket* packet, ArpEntry* entry) {
+static void send_probe(NetworkStack* stack, ArpEntry* entry) {
+    send_arp_packet(stack, &entry->mac, entry->ip, ARP_TYPE_UNICAST_REQUEST);
+    entry->retry_count++;
+    entry->time = get_time();
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Keeps the used list in LRU order. A stale entry which is still in use is probed, so it is confirmed
+// before it would expire.
+static void mark_as_used(NetworkStack* stack, ArpEntry* entry) {
+    list_remove(&entry->list_node);
+    list_add_last(&entry->list_node, &stack->arp.used_entries);
+
+    if (entry->state == ARP_STATE_STALE) {
+        entry->state = ARP_STATE_PROBE;
+        entry->retry_count = 0;
+        send_probe(stack, entry);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void add_to_arp_entry_queue(NetworkStack* stack, NetworkPacket* packet, ArpEntry* entry) {
     if (entry->packet_count == ARP_ENTRY_MAX_QUEUE_SIZE) {
         ListNode* node = list_remove_first(&entry->packet_queue);
         NetworkPacket* packet_to_delete = get_struct_containing_list_node(node, NetworkPacket, list_node);
 
         // Evict the least recently added packet.
-        free_network_packet(packet_to_delete);
+        free_network_packet(stack, packet_to_delete);
         entry->packet_count--;
     }
 
@@ -193,27 +271,59 @@ static void add_to_arp_entry_queue(NetworkPacket* packet, ArpEntry* entry) {
 
 //--------------------------------------------------------------------------------------------------
 
-void arp_send(NetworkPacket* packet, Ip ip) {
-    ArpEntry* entry = find_arp_entry(ip);
+// Returns false if the driver could not take the frame. A packet waiting for address resolution
+// counts as sent, since the ARP layer owns it from then on.
+bool arp_send(NetworkStack* stack, NetworkPacket* packet, Ip ip) {
+    ArpEntry* entry = find_arp_entry(stack, ip);
 
     if (entry) {
-        if (entry->contain_valid_mapping) {
-            mac_send(packet, &entry->mac, ETHER_TYPE_IPV4);
-            return;
+        mark_as_used(stack, entry);
+
+        if (entry->state != ARP_STATE_INCOMPLETE) {
+            return mac_send(stack, packet, &entry->mac, ETHER_TYPE_IPV4);
         }
         
-        add_to_arp_entry_queue(packet, entry);
-        return;
+        add_to_arp_entry_queue(stack, packet, entry);
+        return true;
     }
 
-    entry = allocate_entry();
+    entry = allocate_entry(stack, ip);
+    entry->time = get_time();
 
-    entry->ip = ip;
-    entry->contain_valid_mapping = false;
+    add_to_arp_entry_queue(stack, packet, entry);
+    send_arp_packet(stack, 0, ip, ARP_TYPE_REQUEST);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Same as arp_send, but without a packet to queue. For senders with more packets than the queue holds.
+void arp_resolve(NetworkStack* stack, Ip ip) {
+    ArpEntry* entry = find_arp_entry(stack, ip);
+
+    if (entry) {
+        mark_as_used(stack, entry);
+        return;
+    }
+
+    entry = allocate_entry(stack, ip);
     entry->time = get_time();
 
-    add_to_arp_entry_queue(packet, entry);
-    send_arp_packet(0, ip, ARP_TYPE_REQUEST);
+    send_arp_packet(stack, 0, ip, ARP_TYPE_REQUEST);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool arp_lookup(NetworkStack* stack, Ip ip, Mac* mac) {
+    ArpEntry* entry = find_arp_entry(stack, ip);
+
+    if (entry == 0 || entry->state == ARP_STATE_INCOMPLETE) {
+        return false;
+    }
+
+    mark_as_used(stack, entry);
+    memory_copy(&entry->mac, mac, sizeof(Mac));
+    return true;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -236,7 +346,7 @@ static bool validate_arp_header(ArpHeader* header) {
 
 //--------------------------------------------------------------------------------------------------
 
-static void send_packets_on_entry(ArpEntry* entry) {
+static void send_packets_on_entry(NetworkStack* stack, ArpEntry* entry) {
     while (1) {
         ListNode* node = list_remove_first(&entry->packet_queue);
 
@@ -245,28 +355,46 @@ static void send_packets_on_entry(ArpEntry* entry) {
         }
 
         NetworkPacket* packet = get_struct_containing_list_node(node, NetworkPacket, list_node);
-        mac_send(packet, &entry->mac, ETHER_TYPE_IPV4);
+        entry->packet_count--;
+
+        if (mac_send(stack, packet, &entry->mac, ETHER_TYPE_IPV4) == false) {
+            free_network_packet(stack, packet);
+        }
     }
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static void update_arp_mapping(Ip ip, Mac* mac, bool update_only_if_not_valid) {
-    ArpEntry* entry = find_arp_entry(ip);
+// Stores the MAC of a host in the given state. If create is not set, only known hosts are updated. A
+// STALE update of a valid entry with the same MAC is ignored, so it does not undo a confirmation.
+static void update_arp_mapping(NetworkStack* stack, Ip ip, const Mac* mac, bool create, ArpState state) {
+    ArpEntry* entry = find_arp_entry(stack, ip);
+
+    if (entry == 0) {
+        if (create == false) {
+            return;
+        }
 
-    if (entry == 0 || (update_only_if_not_valid && entry->contain_valid_mapping == true)) {
+        entry = allocate_entry(stack, ip);
+    }
+    else if (entry->state != ARP_STATE_INCOMPLETE && memory_compare(mac, &entry->mac, sizeof(Mac)) == false) {
+        stack->arp.generation++;
+    }
+    else if (entry->state != ARP_STATE_INCOMPLETE && state == ARP_STATE_STALE) {
+        // Nothing new is learned, and the state of the entry is better than what we know.
         return;
     }
 
     memory_copy(mac, &entry->mac, sizeof(Mac));
-    entry->contain_valid_mapping = true;
+    entry->state = state;
+    entry->retry_count = 0;
     entry->time = get_time();
-    send_packets_on_entry(entry);
+    send_packets_on_entry(stack, entry);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void handle_arp(NetworkPacket* packet) {
+void handle_arp(NetworkStack* stack, NetworkPacket* packet) {
     if (packet->length < sizeof(ArpHeader)) {
         goto free;
     }
@@ -281,43 +409,100 @@ void handle_arp(NetworkPacket* packet) {
     Ip senders_ip = read_be32(&header->senders_ip);
     Ip target_ip = read_be32(&header->target_ip);
 
+    Ip our_ip = get_our_ip(stack);
+
     if (operation == ARP_OPERATION_REPLY) {
-        if (senders_ip != target_ip && target_ip == get_our_ip()) {
+        if (senders_ip != target_ip && target_ip == our_ip) {
             // Incoming ARP reply. 
-            update_arp_mapping(senders_ip, &header->senders_mac, true);
+            update_arp_mapping(stack, senders_ip, &header->senders_mac, false, ARP_STATE_REACHABLE);
         }
     }
-    else if (operation == ARP_OPERATION_REQUEST) {
-        if (senders_ip && senders_ip != target_ip && target_ip == get_our_ip()) {
+    else if (operation == ARP_OPERATION_REQUEST && senders_ip && senders_ip != our_ip) {
+        // The sender of a request aimed at us is about to talk to us, so its mapping is stored before
+        // we reply. This saves a request of our own when we answer it. A request for another host is
+        // broadcast and proves nothing about our path to the sender, so it only updates a mapping we
+        // already have, and a changed one starts out stale.
+        if (senders_ip != target_ip && target_ip == our_ip) {
+            update_arp_mapping(stack, senders_ip, &header->senders_mac, true, ARP_STATE_REACHABLE);
+
             // Incoming ARP request. Respond with ARP reply.
-            send_arp_packet(&header->senders_mac, header->senders_ip, ARP_TYPE_REPLY);
+            send_arp_packet(stack, &header->senders_mac, senders_ip, ARP_TYPE_REPLY);
+        }
+        else {
+            update_arp_mapping(stack, senders_ip, &header->senders_mac, false, ARP_STATE_STALE);
         }
     }
 
     free:
-    free_network_packet(packet);
+    free_network_packet(stack, packet);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void arp_task() {
-    list_iterate_safe(it, &used_entries) {
+// Learns the MAC of a neighbour from a unicast IP frame it sent us. Unlike an ARP packet, the frame
+// does not prove the mapping is current, so a new or changed mapping starts out stale. It is used
+// right away, and confirmed with a unicast probe the first time we send to the host. Hosts we do not
+// reach directly are skipped, since their frames carry the MAC of the router.
+void arp_glean(NetworkStack* stack, Ip ip, const Mac* mac) {
+    Ip our_ip = get_our_ip(stack);
+
+    if (our_ip == 0 || ip == 0 || ip == our_ip || route_lookup(stack, ip) != ip) {
+        return;
+    }
+
+    update_arp_mapping(stack, ip, mac, true, ARP_STATE_STALE);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void arp_task(NetworkStack* stack) {
+    if (get_elapsed(stack->arp.task_time, get_time()) < ARP_TASK_INTERVAL) {
+        return;
+    }
+
+    stack->arp.task_time = get_time();
+
+    list_iterate_safe(it, &stack->arp.used_entries) {
         ArpEntry* entry = get_struct_containing_list_node(it, ArpEntry, list_node);
+        u32 elapsed = get_elapsed(entry->time, get_time());
 
+        if (entry->state == ARP_STATE_REACHABLE) {
+            // Anything caching the MAC looks it up again, which starts a probe if it is still in use.
+            if (elapsed > ARP_REACHABLE_TIME) {
+                entry->state = ARP_STATE_STALE;
+                stack->arp.generation++;
+            }
+        }
+        else if (entry->state == ARP_STATE_STALE) {
+            if (elapsed > ARP_ENTRY_EXPIRATION_INTERVAL) {
+                free_entry(stack, entry);
+            }
+        }
+        else if (entry->state == ARP_STATE_PROBE) {
+            if (elapsed <= ARP_RETRY_INTERVAL) {
+                continue;
+            }
 
-        if (entry->contain_valid_mapping) {
-            if (get_elapsed(entry->time, get_time()) > ARP_ENTRY_EXPIRATION_INTERVAL) {
-                free_entry(entry);
+            if (entry->retry_count < ARP_PROBE_MAX_COUNT) {
+                send_probe(stack, entry);
+                continue;
             }
+
+            // The peer did not answer at its known MAC. Stop using it and resolve it from scratch.
+            entry->state = ARP_STATE_INCOMPLETE;
+            entry->retry_count = 0;
+            entry->time = get_time();
+            stack->arp.generation++;
+            send_arp_packet(stack, 0, entry->ip, ARP_TYPE_REQUEST);
         }
-        else if (get_elapsed(entry->time, get_time()) > ARP_RETRY_INTERVAL) {
+        else if (elapsed > ARP_RETRY_INTERVAL) {
             if (entry->retry_count < ARP_RETRY_MAX_COUNT) {
-                send_arp_packet(0, entry->ip, ARP_TYPE_REQUEST);
+                send_arp_packet(stack, 0, entry->ip, ARP_TYPE_REQUEST);
                 entry->retry_count++;
                 entry->time = get_time();
             }
             else {
-                free_entry(entry);
+                free_entry(stack, entry);
             }
         }
     }
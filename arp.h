@@ -5,12 +5,87 @@
 
 #include "utilities.h"
 #include "network.h"
+#include "list.h"
+#include "time.h"
 
 //--------------------------------------------------------------------------------------------------
 
-void arp_init();
-void arp_task();
-void arp_send(NetworkPacket* packet, Ip ip);
-void handle_arp(NetworkPacket* packet);
+#ifndef ARP_ENTRY_COUNT
+#define ARP_ENTRY_COUNT 256
+#endif
+
+// Learn the MAC of neighbours from the unicast IP frames they send us, not only from ARP.
+#ifndef ARP_GLEAN_FROM_IP
+#define ARP_GLEAN_FROM_IP 1
+#endif
+
+// Entries are found through a hash of the IP. Each bucket is a list of entries. The bucket count
+// follows ARP_ENTRY_COUNT, so a full table has about two entries per bucket up to 4096 entries.
+#if ARP_ENTRY_COUNT <= 16
+#define ARP_BUCKET_BITS   3
+#elif ARP_ENTRY_COUNT <= 64
+#define ARP_BUCKET_BITS   5
+#elif ARP_ENTRY_COUNT <= 256
+#define ARP_BUCKET_BITS   7
+#elif ARP_ENTRY_COUNT <= 1024
+#define ARP_BUCKET_BITS   9
+#else
+#define ARP_BUCKET_BITS   11
+#endif
+
+#define ARP_BUCKET_COUNT  (1 << ARP_BUCKET_BITS)
+
+//--------------------------------------------------------------------------------------------------
+
+// INCOMPLETE entries are being resolved by broadcast requests and hold the packets sent to them. The
+// other states have a valid mapping. A REACHABLE entry turns STALE after a while. If a STALE entry is
+// used, the known MAC is probed with unicast requests while packets are still sent to it, and the
+// entry only goes back to INCOMPLETE if the probes are not answered.
+typedef enum {
+    ARP_STATE_INCOMPLETE,
+    ARP_STATE_REACHABLE,
+    ARP_STATE_STALE,
+    ARP_STATE_PROBE,
+} ArpState;
+
+typedef struct {
+    Mac      mac;
+    Ip       ip;
+    ArpState state;
+    Time     time;
+    int      retry_count;
+    List     packet_queue;
+    int      packet_count;
+
+    // In the free list, or in the used list ordered from least to most recently used.
+    ListNode list_node;
+    ListNode bucket_node;
+} ArpEntry;
+
+typedef struct {
+    ArpEntry entries[ARP_ENTRY_COUNT];
+    List free_entries;
+    List used_entries;
+    List buckets[ARP_BUCKET_COUNT];
+
+    // The used entries are only checked for timeouts every ARP_TASK_INTERVAL.
+    Time task_time;
+
+    // Incremented whenever a mapping changes or is removed. Anything caching a MAC address from the
+    // table compares against this to know when to look it up again.
+    u32 generation;
+} Arp;
+
+//--------------------------------------------------------------------------------------------------
+
+void arp_init(NetworkStack* stack);
+void arp_task(NetworkStack* stack);
+bool arp_send(NetworkStack* stack, NetworkPacket* packet, Ip ip);
+void arp_resolve(NetworkStack* stack, Ip ip);
+
+// Returns false if the IP is not resolved. Nothing is sent in that case.
+bool arp_lookup(NetworkStack* stack, Ip ip, Mac* mac);
+void arp_glean(NetworkStack* stack, Ip ip, const Mac* mac);
+void handle_arp(NetworkStack* stack, NetworkPacket* packet);
 
 #endif
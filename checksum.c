@@ -0,0 +1,369 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+// The intrinsics must be included before utilities.h, which defines __r and __w.
+#if defined(__AVX2__) || defined(__SSE2__)
+#include "immintrin.h"
+#elif defined(__ARM_NEON)
+#include "arm_neon.h"
+#endif
+
+#include "checksum.h"
+
+//--------------------------------------------------------------------------------------------------
+
+// The data is summed as native endian 32-bit words into a 64-bit accumulator. Since 2^16 is 1 in one's
+// complement arithmetic, this gives the same result as adding 16-bit words once folded. Summing in
+// native order and swapping the folded result is also equivalent to summing big endian words. The
+// vector kernel is picked at build time from the target flags.
+
+//--------------------------------------------------------------------------------------------------
+
+static inline u32 load_u32(const u8* pointer) {
+    u32 value;
+    __builtin_memcpy(&value, pointer, sizeof(u32));
+    return value;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static inline u16 load_u16(const u8* pointer) {
+    u16 value;
+    __builtin_memcpy(&value, pointer, sizeof(u16));
+    return value;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static inline u32 copy_u32(const u8* source, u8* dest) {
+    u32 value = load_u32(source);
+    __builtin_memcpy(dest, &value, sizeof(u32));
+    return value;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static inline u32 fold(u64 sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return (u32)sum;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static inline u32 swap_bytes(u32 sum) {
+    return ((sum >> 8) & 0xFF) | ((sum & 0xFF) << 8);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+#if defined(__AVX2__)
+
+// Adds 32 bytes per iteration. Each 32-bit word is widened to 64 bits, so the lanes can not overflow.
+static u64 sum_vector(const u8** data, int* size) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i accumulator = zero;
+
+    while (*size >= 32) {
+        __m256i words = _mm256_loadu_si256((const __m256i *)*data);
+
+        accumulator = _mm256_add_epi64(accumulator, _mm256_unpacklo_epi32(words, zero));
+        accumulator = _mm256_add_epi64(accumulator, _mm256_unpackhi_epi32(words, zero));
+
+        *data += 32;
+        *size -= 32;
+    }
+
+    u64 lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, accumulator);
+
+    return fold(lanes[0]) + fold(lanes[1]) + fold(lanes[2]) + fold(lanes[3]);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u64 copy_and_sum_vector(const u8** source, u8** dest, int* size) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i accumulator = zero;
+
+    while (*size >= 32) {
+        __m256i words = _mm256_loadu_si256((const __m256i *)*source);
+        _mm256_storeu_si256((__m256i *)*dest, words);
+
+        accumulator = _mm256_add_epi64(accumulator, _mm256_unpacklo_epi32(words, zero));
+        accumulator = _mm256_add_epi64(accumulator, _mm256_unpackhi_epi32(words, zero));
+
+        *source += 32;
+        *dest += 32;
+        *size -= 32;
+    }
+
+    u64 lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, accumulator);
+
+    return fold(lanes[0]) + fold(lanes[1]) + fold(lanes[2]) + fold(lanes[3]);
+}
+
+#elif defined(__SSE2__)
+
+// Adds 32 bytes per iteration. Each 32-bit word is widened to 64 bits, so the lanes can not overflow.
+static u64 sum_vector(const u8** data, int* size) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i accumulator0 = zero;
+    __m128i accumulator1 = zero;
+
+    while (*size >= 32) {
+        __m128i words0 = _mm_loadu_si128((const __m128i *)*data);
+        __m128i words1 = _mm_loadu_si128((const __m128i *)(*data + 16));
+
+        accumulator0 = _mm_add_epi64(accumulator0, _mm_unpacklo_epi32(words0, zero));
+        accumulator1 = _mm_add_epi64(accumulator1, _mm_unpackhi_epi32(words0, zero));
+        accumulator0 = _mm_add_epi64(accumulator0, _mm_unpacklo_epi32(words1, zero));
+        accumulator1 = _mm_add_epi64(accumulator1, _mm_unpackhi_epi32(words1, zero));
+
+        *data += 32;
+        *size -= 32;
+    }
+
+    u64 lanes[4];
+    _mm_storeu_si128((__m128i *)&lanes[0], accumulator0);
+    _mm_storeu_si128((__m128i *)&lanes[2], accumulator1);
+
+    return fold(lanes[0]) + fold(lanes[1]) + fold(lanes[2]) + fold(lanes[3]);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u64 copy_and_sum_vector(const u8** source, u8** dest, int* size) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i accumulator0 = zero;
+    __m128i accumulator1 = zero;
+
+    while (*size >= 32) {
+        __m128i words0 = _mm_loadu_si128((const __m128i *)*source);
+        __m128i words1 = _mm_loadu_si128((const __m128i *)(*source + 16));
+
+        _mm_storeu_si128((__m128i *)*dest, words0);
+        _mm_storeu_si128((__m128i *)(*dest + 16), words1);
+
+        accumulator0 = _mm_add_epi64(accumulator0, _mm_unpacklo_epi32(words0, zero));
+        accumulator1 = _mm_add_epi64(accumulator1, _mm_unpackhi_epi32(words0, zero));
+        accumulator0 = _mm_add_epi64(accumulator0, _mm_unpacklo_epi32(words1, zero));
+        accumulator1 = _mm_add_epi64(accumulator1, _mm_unpackhi_epi32(words1, zero));
+
+        *source += 32;
+        *dest += 32;
+        *size -= 32;
+    }
+
+    u64 lanes[4];
+    _mm_storeu_si128((__m128i *)&lanes[0], accumulator0);
+    _mm_storeu_si128((__m128i *)&lanes[2], accumulator1);
+
+    return fold(lanes[0]) + fold(lanes[1]) + fold(lanes[2]) + fold(lanes[3]);
+}
+
+#elif defined(__ARM_NEON)
+
+// Adds 32 bytes per iteration. The pairwise add and accumulate widens the 32-bit words to 64 bits.
+static u64 sum_vector(const u8** data, int* size) {
+    uint64x2_t accumulator0 = vdupq_n_u64(0);
+    uint64x2_t accumulator1 = vdupq_n_u64(0);
+
+    while (*size >= 32) {
+        accumulator0 = vpadalq_u32(accumulator0, vreinterpretq_u32_u8(vld1q_u8(*data)));
+        accumulator1 = vpadalq_u32(accumulator1, vreinterpretq_u32_u8(vld1q_u8(*data + 16)));
+
+        *data += 32;
+        *size -= 32;
+    }
+
+    uint64x2_t accumulator = vaddq_u64(accumulator0, accumulator1);
+    return fold(vgetq_lane_u64(accumulator, 0)) + fold(vgetq_lane_u64(accumulator, 1));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u64 copy_and_sum_vector(const u8** source, u8** dest, int* size) {
+    uint64x2_t accumulator0 = vdupq_n_u64(0);
+    uint64x2_t accumulator1 = vdupq_n_u64(0);
+
+    while (*size >= 32) {
+        uint8x16_t words0 = vld1q_u8(*source);
+        uint8x16_t words1 = vld1q_u8(*source + 16);
+
+        vst1q_u8(*dest, words0);
+        vst1q_u8(*dest + 16, words1);
+
+        accumulator0 = vpadalq_u32(accumulator0, vreinterpretq_u32_u8(words0));
+        accumulator1 = vpadalq_u32(accumulator1, vreinterpretq_u32_u8(words1));
+
+        *source += 32;
+        *dest += 32;
+        *size -= 32;
+    }
+
+    uint64x2_t accumulator = vaddq_u64(accumulator0, accumulator1);
+    return fold(vgetq_lane_u64(accumulator, 0)) + fold(vgetq_lane_u64(accumulator, 1));
+}
+
+#else
+
+// Adds 16 bytes per iteration.
+static u64 sum_vector(const u8** data, int* size) {
+    const u8* pointer = *data;
+    u64 sum = 0;
+
+    while (*size >= 16) {
+        sum += load_u32(pointer + 0);
+        sum += load_u32(pointer + 4);
+        sum += load_u32(pointer + 8);
+        sum += load_u32(pointer + 12);
+
+        pointer += 16;
+        *size -= 16;
+    }
+
+    *data = pointer;
+    return sum;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u64 copy_and_sum_vector(const u8** source, u8** dest, int* size) {
+    const u8* from = *source;
+    u8* to = *dest;
+    u64 sum = 0;
+
+    while (*size >= 16) {
+        sum += copy_u32(from + 0, to + 0);
+        sum += copy_u32(from + 4, to + 4);
+        sum += copy_u32(from + 8, to + 8);
+        sum += copy_u32(from + 12, to + 12);
+
+        from += 16;
+        to += 16;
+        *size -= 16;
+    }
+
+    *source = from;
+    *dest = to;
+    return sum;
+}
+
+#endif
+
+//--------------------------------------------------------------------------------------------------
+
+u32 checksum_add(u32 sum, const void* data, int size) {
+    const u8* pointer = data;
+    u64 native_sum = sum_vector(&pointer, &size);
+
+    while (size >= 4) {
+        native_sum += load_u32(pointer);
+        pointer += 4;
+        size -= 4;
+    }
+
+    if (size >= 2) {
+        native_sum += load_u16(pointer);
+        pointer += 2;
+        size -= 2;
+    }
+
+    // The odd byte is the high byte of a big endian word.
+    if (size) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        native_sum += *pointer;
+#else
+        native_sum += *pointer << 8;
+#endif
+    }
+
+    u32 partial = fold(native_sum);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    partial = swap_bytes(partial);
+#endif
+
+    return fold((u64)sum + partial);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Same as checksum_add, but the data is copied to dest in the same pass, so every byte is only loaded
+// once.
+u32 checksum_copy(u32 sum, const void* source, void* dest, int size) {
+    const u8* from = source;
+    u8* to = dest;
+    u64 native_sum = copy_and_sum_vector(&from, &to, &size);
+
+    while (size >= 4) {
+        native_sum += copy_u32(from, to);
+        from += 4;
+        to += 4;
+        size -= 4;
+    }
+
+    if (size >= 2) {
+        native_sum += load_u16(from);
+        to[0] = from[0];
+        to[1] = from[1];
+        from += 2;
+        to += 2;
+        size -= 2;
+    }
+
+    if (size) {
+        *to = *from;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        native_sum += *from;
+#else
+        native_sum += *from << 8;
+#endif
+    }
+
+    u32 partial = fold(native_sum);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    partial = swap_bytes(partial);
+#endif
+
+    return fold((u64)sum + partial);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The partial sum of data which starts at an odd offset has its bytes swapped compared to the sum at
+// an even offset, since all its words are shifted by one byte.
+u32 checksum_swap(u32 partial) {
+    return swap_bytes(fold(partial));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Sums the data of the whole chain. A buffer may end on an odd byte, which shifts the data of the
+// following buffers.
+u32 checksum_add_packet(u32 sum, NetworkPacket* packet) {
+    bool odd = false;
+
+    for (; packet; packet = packet->next) {
+        u32 partial = checksum_add(0, (const u8 *)&packet->data[packet->index], packet->length);
+
+        if (odd) {
+            partial = checksum_swap(partial);
+        }
+
+        sum = fold((u64)sum + partial);
+        odd ^= packet->length & 1;
+    }
+
+    return sum;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+u16 checksum_finish(u32 sum) {
+    return (u16)~fold(sum);
+}
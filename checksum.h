@@ -0,0 +1,21 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "utilities.h"
+#include "network.h"
+
+//--------------------------------------------------------------------------------------------------
+
+// Internet checksum (RFC 1071). A partial sum is the one's complement sum of the data read as big
+// endian 16-bit words. Partial sums can be added together, and with host order values like the
+// fields of a pseudo header, as long as each piece starts at an even offset. checksum_finish turns
+// the sum into the value written to the header.
+u32 checksum_add(u32 sum, const void* data, int size);
+u32 checksum_copy(u32 sum, const void* source, void* dest, int size);
+u32 checksum_swap(u32 partial);
+u32 checksum_add_packet(u32 sum, NetworkPacket* packet);
+u16 checksum_finish(u32 sum);
+
+#endif
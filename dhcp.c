@@ -6,6 +6,8 @@
 #include "time.h"
 #include "udp.h"
 #include "ip.h"
+#include "stack.h"
+#include "route.h"
 
 //--------------------------------------------------------------------------------------------------
 
@@ -16,6 +18,9 @@
 #define DHCP_SERVER_PORT 67
 #define DHCP_CLIENT_PORT 68
 
+// Upper bound on the options added by dhcp_send_packet, including the end option.
+#define DHCP_SEND_OPTIONS_SIZE 20
+
 //--------------------------------------------------------------------------------------------------
 
 enum {
@@ -50,10 +55,12 @@ enum {
 
 enum {
     DHCP_OPTION_SUBNET_MASK          = 1,
+    DHCP_OPTION_ROUTER               = 3,
     DHCP_OPTION_REQUESTED_IP_ADDRESS = 50,
     DHCP_OPTION_LEASE_TIME           = 51,
     DHCP_OPTION_MESSAGE_TYPE         = 53,
     DHCP_OPTION_SERVER_IDENTIFIER    = 54,
+    DHCP_OPTION_PARAMETER_REQUEST    = 55,
     DHCP_OPTION_END                  = 255,
 };
 
@@ -68,35 +75,11 @@ enum {
     OPTION_NETMASK      = 1 << 2,
     OPTION_MESSAGE_TYPE = 1 << 3,
     OPTION_LEASE_TIME   = 1 << 4,
+    OPTION_ROUTER       = 1 << 5,
 };
 
 //--------------------------------------------------------------------------------------------------
 
-typedef struct {
-    int state;
-    u32 transaction_id;
-
-    Time time;
-    Time lease_time;
-
-    Ip leased_ip;
-    Ip server_ip;
-    Ip netmask;
-
-    Backoff backoff;
-    int aquisition_count;
-} Dhcp;
-
-typedef struct {
-    int mask;
-
-    Ip your_ip;
-    Ip server_ip;
-    Ip netmask;
-    int message_type;
-    Time lease_time;
-} DhcpOptions;
-
 typedef struct PACKED {
     u8    opcode;
     u8    hardware_type;
@@ -118,18 +101,21 @@ typedef struct PACKED {
 
 //--------------------------------------------------------------------------------------------------
 
-static Dhcp dhcp;
-static DhcpOptions options;
+void dhcp_init(NetworkStack* stack) {
+    stack->dhcp.state = DHCP_DISABLED;
+}
 
 //--------------------------------------------------------------------------------------------------
 
-void dhcp_start() {
-    dhcp.state = DHCP_DISCOVER;
-    dhcp.transaction_id = random();
-    dhcp.time = get_time();
+void dhcp_start(NetworkStack* stack) {
+    Dhcp* dhcp = &stack->dhcp;
 
-    backoff_init(&dhcp.backoff, DHCP_START_TIMEOUT, DHCP_MAX_TIMEOUT, DHCP_JITTER_FRACTION);
-    udp_listen(DHCP_CLIENT_PORT, 1);
+    dhcp->state = DHCP_DISCOVER;
+    dhcp->transaction_id = random();
+    dhcp->time = get_time();
+
+    backoff_init(&dhcp->backoff, DHCP_START_TIMEOUT, DHCP_MAX_TIMEOUT, DHCP_JITTER_FRACTION);
+    udp_listen(stack, DHCP_CLIENT_PORT, 1);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -160,14 +146,29 @@ void add_server_identifier_option(Ip ip, u8** data) {
 
 //--------------------------------------------------------------------------------------------------
 
+// Some servers only send the options the client asks for.
+void add_parameter_request_option(u8** data) {
+    *(*data)++ = DHCP_OPTION_PARAMETER_REQUEST;
+    *(*data)++ = 2;
+    *(*data)++ = DHCP_OPTION_SUBNET_MASK;
+    *(*data)++ = DHCP_OPTION_ROUTER;
+}
+
+//--------------------------------------------------------------------------------------------------
+
 void finalize_options(u8** data) {
     *(*data)++ = 255;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static void dhcp_send_packet(int dhcp_packet_type) {
-    NetworkPacket* packet = allocate_network_packet();
+static void dhcp_send_packet(NetworkStack* stack, int dhcp_packet_type) {
+    Dhcp* dhcp = &stack->dhcp;
+    NetworkPacket* packet = allocate_reserved_network_packet(stack, sizeof(DhcpHeader) + DHCP_SEND_OPTIONS_SIZE);
+
+    if (packet == 0) {
+        return;
+    }
 
     DhcpHeader* header = (DhcpHeader *)&packet->data[packet->index];
 
@@ -176,47 +177,53 @@ static void dhcp_send_packet(int dhcp_packet_type) {
     header->hardware_length = sizeof(Mac);
     header->hardware_options = 0;
     
-    write_be32(dhcp.transaction_id, &header->transaction_id);
-    write_be16(get_elapsed(dhcp.time, get_time()) / 1000, &header->seconds_elapsed);
+    write_be32(dhcp->transaction_id, &header->transaction_id);
+    write_be16(get_elapsed(dhcp->time, get_time()) / 1000, &header->seconds_elapsed);
     write_be16(0, &header->flags);
     write_be32(0, &header->client_ip);
     write_be32(0, &header->your_ip);
     write_be32(0, &header->next_server_ip);
     write_be32(0, &header->relay_agent_ip);
     write_be32(0x63825363, &header->magic_cookie);
-    memory_copy(get_our_mac(), &header->client_mac, sizeof(Mac));
+    memory_copy(get_our_mac(stack), &header->client_mac, sizeof(Mac));
 
     u8* data = (u8 *)header + sizeof(DhcpHeader);
 
     // Add the options.
     if (dhcp_packet_type == DHCP_PACKET_DISCOVER) {
         add_message_type_option(DHCP_MESSAGE_TYPE_DISCOVER, &data);
+        add_parameter_request_option(&data);
     }
     else if (dhcp_packet_type == DHCP_PACKET_REQUEST) {
         add_message_type_option(DHCP_MESSAGE_TYPE_REQUEST, &data);
-        add_requested_ip_address_option(dhcp.leased_ip, &data);
-        add_server_identifier_option(dhcp.server_ip, &data);
+        add_requested_ip_address_option(dhcp->leased_ip, &data);
+        add_server_identifier_option(dhcp->server_ip, &data);
+        add_parameter_request_option(&data);
     }
     else if (dhcp_packet_type == DHCP_PACKET_RENEW) {
         add_message_type_option(DHCP_MESSAGE_TYPE_REQUEST, &data);
-        write_be32(dhcp.leased_ip, &header->client_ip);
+        write_be32(dhcp->leased_ip, &header->client_ip);
     }
     else if (dhcp_packet_type == DHCP_PACKET_RELEASE) {
         add_message_type_option(DHCP_MESSAGE_TYPE_RELEASE, &data);
-        add_server_identifier_option(dhcp.server_ip, &data);
-        write_be32(dhcp.leased_ip, &header->client_ip);
+        add_server_identifier_option(dhcp->server_ip, &data);
+        write_be32(dhcp->leased_ip, &header->client_ip);
         write_be16(0, &header->seconds_elapsed);
     }
 
     finalize_options(&data);
     
     packet->length = data - (u8 *)header;
-    udp_send_zero_copy(packet, DHCP_CLIENT_PORT, DHCP_SERVER_PORT, 0xFFFFFFFF);
+
+    // The TX ring is full. The retry timer will send a new one.
+    if (udp_send_zero_copy(stack, packet, DHCP_CLIENT_PORT, DHCP_SERVER_PORT, 0xFFFFFFFF) == false) {
+        free_network_packet(stack, packet);
+    }
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static bool verify_dhcp_header(DhcpHeader* header) {
+static bool verify_dhcp_header(NetworkStack* stack, DhcpHeader* header) {
     if (header->hardware_type != 1) {
         return false;
     }
@@ -233,11 +240,11 @@ static bool verify_dhcp_header(DhcpHeader* header) {
         return false;
     }
 
-    if (read_be32(&header->transaction_id) != dhcp.transaction_id) {
+    if (read_be32(&header->transaction_id) != stack->dhcp.transaction_id) {
         return false;
     }
 
-    if (memory_compare(&header->client_mac, get_our_mac(), sizeof(Mac)) == false) {
+    if (memory_compare(&header->client_mac, get_our_mac(stack), sizeof(Mac)) == false) {
         return false;
     }
 
@@ -246,23 +253,24 @@ static bool verify_dhcp_header(DhcpHeader* header) {
 
 //--------------------------------------------------------------------------------------------------
 
-static bool dhcp_read() {
-    NetworkPacket* packet = udp_receive_zero_copy(DHCP_CLIENT_PORT);
+static bool dhcp_read(NetworkStack* stack) {
+    Dhcp* dhcp = &stack->dhcp;
+    NetworkPacket* packet = udp_receive_zero_copy(stack, DHCP_CLIENT_PORT);
     if (packet == 0) {
         return false;
     }
 
     DhcpHeader* header = (DhcpHeader *)&packet->data[packet->index];
 
-    if (verify_dhcp_header(header) == false) {
+    if (verify_dhcp_header(stack, header) == false) {
         goto return_false;
     }
 
     int length = packet->length - sizeof(DhcpHeader);
     u8* option_pointer = (u8 *)header + sizeof(DhcpHeader);
 
-    options.your_ip = read_be32(&header->your_ip);
-    options.mask = 0;
+    dhcp->options.your_ip = read_be32(&header->your_ip);
+    dhcp->options.mask = 0;
 
     // @Todo! option might be placed in the sname field. check option 52.
     while (option_pointer[0] != DHCP_OPTION_END) {
@@ -285,32 +293,41 @@ static bool dhcp_read() {
                 goto return_false;
             }
 
-            options.mask |= OPTION_NETMASK;
-            options.netmask = read_be32(option_pointer);
+            dhcp->options.mask |= OPTION_NETMASK;
+            dhcp->options.netmask = read_be32(option_pointer);
+        }
+        else if (type == DHCP_OPTION_ROUTER) {
+            if (option_length < (int)sizeof(Ip) || option_length % sizeof(Ip)) {
+                goto return_false;
+            }
+
+            // The routers are listed in order of preference. Only the first one is used.
+            dhcp->options.mask |= OPTION_ROUTER;
+            dhcp->options.router = read_be32(option_pointer);
         }
         else if (type == DHCP_OPTION_LEASE_TIME) {
             if (option_length != sizeof(u32)) {
                 goto return_false;
             }
 
-            options.mask |= OPTION_LEASE_TIME;
-            options.lease_time = read_be32(option_pointer);
+            dhcp->options.mask |= OPTION_LEASE_TIME;
+            dhcp->options.lease_time = read_be32(option_pointer);
         }
         else if (type == DHCP_OPTION_SERVER_IDENTIFIER) {
             if (option_length != sizeof(Ip)) {
                 goto return_false;
             }
 
-            options.mask |= OPTION_SERVER_IP;
-            options.server_ip = read_be32(option_pointer);
+            dhcp->options.mask |= OPTION_SERVER_IP;
+            dhcp->options.server_ip = read_be32(option_pointer);
         }
         else if (type == DHCP_OPTION_MESSAGE_TYPE) {
             if (option_length != 1) {
                 goto return_false;
             }
 
-            options.mask |= OPTION_MESSAGE_TYPE;
-            options.message_type = option_pointer[0];
+            dhcp->options.mask |= OPTION_MESSAGE_TYPE;
+            dhcp->options.message_type = option_pointer[0];
         }
 
         length -= option_length;
@@ -327,154 +344,178 @@ static bool dhcp_read() {
         }
     }
 
-    free_network_packet(packet);
+    free_network_packet(stack, packet);
     return true;
 
     return_false:
-    free_network_packet(packet);
+    free_network_packet(stack, packet);
     return false;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static bool try_read_offer() {
-    if (dhcp_read() == false) {
+static bool try_read_offer(NetworkStack* stack) {
+    Dhcp* dhcp = &stack->dhcp;
+
+    if (dhcp_read(stack) == false) {
         return false;
     }
 
     int mask = OPTION_LEASE_TIME | OPTION_SERVER_IP | OPTION_MESSAGE_TYPE;
 
-    if ((options.mask & mask) != mask || options.message_type != DHCP_MESSAGE_TYPE_OFFER) {
+    if ((dhcp->options.mask & mask) != mask || dhcp->options.message_type != DHCP_MESSAGE_TYPE_OFFER) {
         return false;
     }
 
-    dhcp.netmask = options.netmask;
-    dhcp.server_ip = options.server_ip;
-    dhcp.leased_ip = options.your_ip;
+    dhcp->netmask = dhcp->options.netmask;
+    dhcp->server_ip = dhcp->options.server_ip;
+    dhcp->leased_ip = dhcp->options.your_ip;
+    dhcp->router = (dhcp->options.mask & OPTION_ROUTER) ? dhcp->options.router : 0;
 
     return true;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static bool try_read_ack(bool* is_ack) {
-    if (dhcp_read() == false) {
+static bool try_read_ack(NetworkStack* stack, bool* is_ack) {
+    Dhcp* dhcp = &stack->dhcp;
+
+    if (dhcp_read(stack) == false) {
         return false;
     }
 
     int expected_mask = OPTION_LEASE_TIME | OPTION_MESSAGE_TYPE | OPTION_SERVER_IP;
 
-    if ((options.mask & expected_mask) != expected_mask) {
+    if ((dhcp->options.mask & expected_mask) != expected_mask) {
         return false;
     }
 
-    if (options.message_type == DHCP_MESSAGE_TYPE_NACK) {
+    if (dhcp->options.message_type == DHCP_MESSAGE_TYPE_NACK) {
         *is_ack = false;
         return true;
     }
 
-    if (options.message_type != DHCP_MESSAGE_TYPE_ACK) {
+    if (dhcp->options.message_type != DHCP_MESSAGE_TYPE_ACK) {
         return false;
     }
 
-    if (options.netmask != dhcp.netmask || options.server_ip != dhcp.server_ip || options.your_ip != dhcp.leased_ip) {
+    if (dhcp->options.netmask != dhcp->netmask || dhcp->options.server_ip != dhcp->server_ip || dhcp->options.your_ip != dhcp->leased_ip) {
         return false;
     }
 
     *is_ack = true;
-    dhcp.time = get_time();
-    dhcp.lease_time = options.lease_time * 1000;
+    dhcp->time = get_time();
+    dhcp->lease_time = dhcp->options.lease_time * 1000;
 
     return true;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static bool renewing_expired() {
-    return get_elapsed(dhcp.time, get_time()) > (dhcp.lease_time / 2);
+static bool renewing_expired(Dhcp* dhcp) {
+    return get_elapsed(dhcp->time, get_time()) > (dhcp->lease_time / 2);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static bool rebinding_expired() {
-    return get_elapsed(dhcp.time, get_time()) > (3 * dhcp.lease_time / 4);
+static bool rebinding_expired(Dhcp* dhcp) {
+    return get_elapsed(dhcp->time, get_time()) > (3 * dhcp->lease_time / 4);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void dhcp_task() {
-    switch (dhcp.state) {
+// The lease ran out or the server refused to renew it. Neither the IP nor the router are ours to use
+// any more, so start over.
+static void lose_lease(NetworkStack* stack) {
+    Dhcp* dhcp = &stack->dhcp;
+
+    dhcp->state = DHCP_DISCOVER;
+    backoff_reset(&dhcp->backoff);
+
+    route_remove(stack, 0, 0, ROUTE_ORIGIN_DHCP);
+    set_our_ip(stack, 0);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void dhcp_task(NetworkStack* stack) {
+    Dhcp* dhcp = &stack->dhcp;
+
+    switch (dhcp->state) {
         case DHCP_DISABLED : {
             break;
         }   
         case DHCP_DISCOVER : {
-            if (backoff_timeout(&dhcp.backoff)) {
-                dhcp_send_packet(DHCP_PACKET_DISCOVER);
-                next_backoff(&dhcp.backoff);
+            if (backoff_timeout(&dhcp->backoff)) {
+                dhcp_send_packet(stack, DHCP_PACKET_DISCOVER);
+                next_backoff(&dhcp->backoff);
             }
 
-            if (try_read_offer()) {
-                dhcp.state = DHCP_REQUESTING;
-                backoff_reset(&dhcp.backoff);
+            if (try_read_offer(stack)) {
+                dhcp->state = DHCP_REQUESTING;
+                backoff_reset(&dhcp->backoff);
             }
             break;
         }
         case DHCP_REQUESTING : {
-            if (backoff_timeout(&dhcp.backoff)) {
-                dhcp_send_packet(DHCP_PACKET_REQUEST);
-                next_backoff(&dhcp.backoff);
+            if (backoff_timeout(&dhcp->backoff)) {
+                dhcp_send_packet(stack, DHCP_PACKET_REQUEST);
+                next_backoff(&dhcp->backoff);
             }
 
             bool is_ack;
-            if (try_read_ack(&is_ack)) {
+            if (try_read_ack(stack, &is_ack)) {
                 if (is_ack) {
-                    dhcp.state = DHCP_BOUND;
+                    dhcp->state = DHCP_BOUND;
 
                     // Update the global network configuration.
-                    set_our_ip(dhcp.leased_ip);
-                    set_our_netmask(dhcp.netmask);
+                    set_our_ip(stack, dhcp->leased_ip);
+                    set_our_netmask(stack, dhcp->netmask);
+
+                    if (dhcp->router) {
+                        route_add(stack, 0, 0, dhcp->router, ROUTE_ORIGIN_DHCP);
+                    }
                 }
                 else {
-                    dhcp.aquisition_count++;
-                    dhcp.state = DHCP_DISCOVER;
-                    backoff_reset(&dhcp.backoff);
+                    dhcp->aquisition_count++;
+                    dhcp->state = DHCP_DISCOVER;
+                    backoff_reset(&dhcp->backoff);
                 }
             }
             break;
         }
         case DHCP_BOUND : {
-            if (renewing_expired()) {
-                dhcp.state = DHCP_RENEWING;
-                backoff_reset(&dhcp.backoff);
+            if (renewing_expired(dhcp)) {
+                dhcp->state = DHCP_RENEWING;
+                backoff_reset(&dhcp->backoff);
             }
             break;
         }
         case DHCP_RENEWING : {
-            if (rebinding_expired()) {
-                dhcp.state = DHCP_REBINDING;
+            if (rebinding_expired(dhcp)) {
+                dhcp->state = DHCP_REBINDING;
             }
 
-            if (backoff_timeout(&dhcp.backoff)) {
-                dhcp_send_packet(DHCP_PACKET_RENEW);
-                next_backoff(&dhcp.backoff);
+            if (backoff_timeout(&dhcp->backoff)) {
+                dhcp_send_packet(stack, DHCP_PACKET_RENEW);
+                next_backoff(&dhcp->backoff);
             }
 
             bool is_ack;
-            if (try_read_ack(&is_ack)) {
+            if (try_read_ack(stack, &is_ack)) {
                 if (is_ack) {
-                    dhcp.state = DHCP_BOUND;
+                    dhcp->state = DHCP_BOUND;
                 }
                 else {
-                    dhcp.state = DHCP_DISCOVER;
+                    lose_lease(stack);
                 }
             }
 
             break;
         }
         case DHCP_REBINDING : {
-            if (get_elapsed(dhcp.time, get_time()) >= dhcp.lease_time) {
-                dhcp.state = DHCP_DISCOVER;
-                backoff_reset(&dhcp.backoff);
+            if (get_elapsed(dhcp->time, get_time()) >= dhcp->lease_time) {
+                lose_lease(stack);
             }
             break;
         }
@@ -486,18 +527,19 @@ void dhcp_task() {
 
 //--------------------------------------------------------------------------------------------------
 
-void dhcp_release() {
-    dhcp_send_packet(DHCP_PACKET_RELEASE);
+void dhcp_release(NetworkStack* stack) {
+    dhcp_send_packet(stack, DHCP_PACKET_RELEASE);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-bool dhcp_is_done() {
-    return dhcp.state == DHCP_BOUND || dhcp.state == DHCP_RENEWING || dhcp.state == DHCP_REBINDING;
+bool dhcp_is_done(NetworkStack* stack) {
+    int state = stack->dhcp.state;
+    return state == DHCP_BOUND || state == DHCP_RENEWING || state == DHCP_REBINDING;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-Ip dhcp_get_server_ip() {
-    return dhcp.server_ip;
+Ip dhcp_get_server_ip(NetworkStack* stack) {
+    return stack->dhcp.server_ip;
 }
@@ -5,13 +5,50 @@
 
 #include "utilities.h"
 #include "network.h"
+#include "backoff.h"
+#include "time.h"
 
 //--------------------------------------------------------------------------------------------------
 
-void dhcp_start();
-void dhcp_task();
-bool dhcp_is_done();
-Ip dhcp_get_server_ip();
-void dhcp_release();
+typedef struct {
+    int mask;
+
+    Ip your_ip;
+    Ip server_ip;
+    Ip netmask;
+    Ip router;
+    int message_type;
+    Time lease_time;
+} DhcpOptions;
+
+typedef struct {
+    int state;
+    u32 transaction_id;
+
+    Time time;
+    Time lease_time;
+
+    Ip leased_ip;
+    Ip server_ip;
+    Ip netmask;
+
+    // Zero if the server did not give us a router.
+    Ip router;
+
+    Backoff backoff;
+    int aquisition_count;
+
+    // Options parsed from the last received message.
+    DhcpOptions options;
+} Dhcp;
+
+//--------------------------------------------------------------------------------------------------
+
+void dhcp_init(NetworkStack* stack);
+void dhcp_start(NetworkStack* stack);
+void dhcp_task(NetworkStack* stack);
+bool dhcp_is_done(NetworkStack* stack);
+Ip dhcp_get_server_ip(NetworkStack* stack);
+void dhcp_release(NetworkStack* stack);
 
 #endif
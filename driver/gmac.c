@@ -1,6 +1,8 @@
 // Copyright (c) 2021 Bjørn Brodtkorb
 
 #include "gmac.h"
+#include "stack.h"
+#include "filter.h"
 #include "registers.h"
 #include "stdalign.h"
 #include "gpio.h"
@@ -80,16 +82,29 @@ typedef struct {
     };
 } TxDescriptor;
 
-//--------------------------------------------------------------------------------------------------
-
-static volatile alignas(32) TxDescriptor tx_descriptors[TRANSMIT_DESCRIPTOR_COUNT];
-static volatile alignas(32) RxDescriptor rx_descriptors[RECEIVE_DESCRIPTOR_COUNT];
+typedef struct {
+    volatile alignas(32) TxDescriptor tx_descriptors[TRANSMIT_DESCRIPTOR_COUNT];
+    volatile alignas(32) RxDescriptor rx_descriptors[RECEIVE_DESCRIPTOR_COUNT];
+
+    // A frame takes one TX descriptor per packet in its chain. The packet and the number of
+    // descriptors are stored at the first descriptor of the frame.
+    NetworkPacket* tx_packets[TRANSMIT_DESCRIPTOR_COUNT];
+    int tx_buffer_counts[TRANSMIT_DESCRIPTOR_COUNT];
+    NetworkPacket* rx_packets[RECEIVE_DESCRIPTOR_COUNT];
+
+    // The tx_used_count descriptors starting at tx_reclaim_index are owned by the GMAC or waiting to
+    // be reclaimed. tx_pending_count is the number of frames queued since the last doorbell.
+    int tx_index;
+    int tx_reclaim_index;
+    int tx_used_count;
+    int tx_pending_count;
+    int rx_index;
+} Gmac;
 
-static NetworkPacket* tx_packets[TRANSMIT_DESCRIPTOR_COUNT];
-static NetworkPacket* rx_packets[RECEIVE_DESCRIPTOR_COUNT];
+//--------------------------------------------------------------------------------------------------
 
-static int tx_index;
-static int rx_index;
+// There is only one GMAC peripheral, so only one stack can use this driver.
+static Gmac gmac;
 
 //--------------------------------------------------------------------------------------------------
 
@@ -139,7 +154,9 @@ static void update_phy_settings() {
 
 //--------------------------------------------------------------------------------------------------
 
-void gmac_init() {
+void gmac_init(NetworkStack* stack) {
+    stack->driver = &gmac;
+
     // @Verify the correct pin configuration.
     set_gpio_function(GPIOD,  0, GPIO_FUNCTION_A);
     set_gpio_function(GPIOD,  1, GPIO_FUNCTION_A);
@@ -163,33 +180,47 @@ void gmac_init() {
 
     // Configure the DMA descriptors.
     for (int i = 0; i < TRANSMIT_DESCRIPTOR_COUNT; i++) {
-        tx_packets[i] = allocate_network_packet();
-        tx_descriptors[i].owner = OWNER_CPU;
+        gmac.tx_packets[i] = 0;
+        gmac.tx_descriptors[i].owner = OWNER_CPU;
     }
 
     for (int i = 0; i < RECEIVE_DESCRIPTOR_COUNT; i++) {
-        rx_packets[i] = allocate_network_packet();
-        rx_descriptors[i].address = (u32)rx_packets[i]->data >> 2;
+        gmac.rx_packets[i] = allocate_reserved_network_packet(stack, NETWORK_RX_PACKET_SIZE);
+        gmac.rx_descriptors[i].address = (u32)gmac.rx_packets[i]->data >> 2;
     }
 
-    tx_descriptors[TRANSMIT_DESCRIPTOR_COUNT - 1].wrap = 1;
-    rx_descriptors[RECEIVE_DESCRIPTOR_COUNT - 1].wrap = 1;
+    gmac.tx_descriptors[TRANSMIT_DESCRIPTOR_COUNT - 1].wrap = 1;
+    gmac.rx_descriptors[RECEIVE_DESCRIPTOR_COUNT - 1].wrap = 1;
 
-    tx_index = 0;
-    rx_index = 0;
+    gmac.tx_index = 0;
+    gmac.tx_reclaim_index = 0;
+    gmac.tx_used_count = 0;
+    gmac.tx_pending_count = 0;
+    gmac.rx_index = 0;
 
-    GMAC->TBQB = (u32)tx_descriptors;
-    GMAC->RBQB = (u32)rx_descriptors;
+    GMAC->TBQB = (u32)gmac.tx_descriptors;
+    GMAC->RBQB = (u32)gmac.rx_descriptors;
 
     // Select MII mode.
     GMAC->UR = 1 << 0;
 
-    // DMA configuration. INCR4 AHB bursts.
-    GMAC->DCFGR = 4 << 0 | (NETWORK_PACKET_SIZE / 64) << 16;
-
-    // Copy all frames, remove frame check sequence, set MDIO clock frequency, don't copy pause frames, 
-    // enable RX checksum offloading.
-    GMAC->NCFGR = 1 << 17 | 4 << 18 | 1 << 23 | 1 << 24;
+    // DMA configuration. INCR4 AHB bursts, use the full 4 KB TX packet buffer and generate the IP and
+    // UDP checksums of outgoing frames. Checksum generation needs the whole frame in the packet buffer
+    // before it is sent, which the full buffer size allows.
+    GMAC->DCFGR = 4 << 0 | 1 << 10 | 1 << 11 | (NETWORK_PACKET_SIZE / 64) << 16;
+    stack->tx_checksum_offload = true;
+
+    // Filter multicast frames with the hash registers, remove frame check sequence, set MDIO clock
+    // frequency, don't copy pause frames, enable RX checksum offloading. No group is let through
+    // until gmac_set_multicast_filter is called.
+    GMAC->HRB = 0;
+    GMAC->HRT = 0;
+    GMAC->NCFGR = 1 << 6 | 1 << 17 | 4 << 18 | 1 << 23 | 1 << 24;
+
+    // Jumbo frames.
+    if (NETWORK_MTU > 1500) {
+        GMAC->NCFGR |= 1 << 3;
+    }
 
     // Enable the transmitter and receiver, enable the MDIO port.
     GMAC->NCR = 1 << 2 | 1 << 3 | 1 << 4;
@@ -206,82 +237,362 @@ void gmac_init() {
 
 //--------------------------------------------------------------------------------------------------
 
-void gmac_deinit() {
+void gmac_deinit(NetworkStack* stack) {
+    (void)stack;
     GMAC->NCR = 0;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void gmac_set_mac_address(const Mac* mac) {
+void gmac_set_mac_address(NetworkStack* stack, const Mac* mac) {
+    (void)stack;
     GMAC->SA[0].BOTTOM = mac->address[3] << 24 | mac->address[2] << 16 | mac->address[1] << 8 | mac->address[0];
     GMAC->SA[0].TOP = mac->address[5] << 8 | mac->address[4];
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void gmac_send(NetworkPacket* packet) {
-    volatile TxDescriptor* descriptor = &tx_descriptors[tx_index];
+// The GMAC hashes the destination MAC to one of 64 bits. Bit i of the hash is the XOR of every sixth
+// bit of the address starting at bit i, where bit 0 is the least significant bit of the first byte.
+static int get_multicast_hash(const Mac* mac) {
+    int hash = 0;
+
+    for (int bit = 0; bit < 48; bit++) {
+        if (mac->address[bit / 8] & (1 << (bit % 8))) {
+            hash ^= 1 << (bit % 6);
+        }
+    }
+
+    return hash;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// A frame is received if the bit of its hash is set. The multicast hash match bit in the RX descriptor
+// tells the stack which frames got through this way.
+void gmac_set_multicast_filter(NetworkStack* stack, const Mac* macs, int count) {
+    (void)stack;
+    u64 hash_bits = 0;
+
+    for (int i = 0; i < count; i++) {
+        hash_bits |= (u64)1 << get_multicast_hash(&macs[i]);
+    }
+
+    GMAC->HRB = (u32)hash_bits;
+    GMAC->HRT = (u32)(hash_bits >> 32);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int next_tx_index(int index) {
+    return (index + 1 == TRANSMIT_DESCRIPTOR_COUNT) ? 0 : index + 1;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Frees the packets of all frames the GMAC has finished sending. The GMAC hands a frame back by setting
+// the used bit in its first descriptor, and it does so in ring order.
+static void reclaim_transmitted(NetworkStack* stack) {
+    Gmac* gmac = stack->driver;
+
+    while (gmac->tx_used_count) {
+        int index = gmac->tx_reclaim_index;
+        int buffer_count = gmac->tx_buffer_counts[index];
+
+        if (gmac->tx_descriptors[index].owner == OWNER_GMAC) {
+            break;
+        }
+
+        free_network_packet(stack, gmac->tx_packets[index]);
+        gmac->tx_packets[index] = 0;
+
+        // The used bit is not written back to the rest of the descriptors of the frame.
+        for (int i = 1; i < buffer_count; i++) {
+            index = next_tx_index(index);
+            gmac->tx_descriptors[index].owner = OWNER_CPU;
+        }
+
+        gmac->tx_reclaim_index = next_tx_index(index);
+        gmac->tx_used_count -= buffer_count;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Each packet in the chain gets its own descriptor. Only the last one is marked as the last buffer.
+bool gmac_send(NetworkStack* stack, NetworkPacket* packet) {
+    Gmac* gmac = stack->driver;
 
     if (GMAC->TSR & (1 << 8 | 1 << 4 | 1 << 2)) {
         // @Incomplete: handle transmit errors.
         while (1);
     }
 
-    // Network saturation. Drop the packet.
-    if (descriptor->owner == OWNER_GMAC) {
-        free_network_packet(packet);
-        return;
+    reclaim_transmitted(stack);
+
+    int buffer_count = 0;
+
+    for (NetworkPacket* it = packet; it; it = it->next) {
+        buffer_count++;
+    }
+
+    // Network saturation. The caller still owns the packet. Make sure the queued frames are being
+    // sent, otherwise the ring never drains if the caller keeps retrying before the next flush.
+    if (buffer_count > TRANSMIT_DESCRIPTOR_COUNT - gmac->tx_used_count) {
+        gmac_flush(stack);
+        return false;
     }
 
-    // Free the old packet.
-    free_network_packet(tx_packets[tx_index]);
-    tx_packets[tx_index] = packet;
+    int first = gmac->tx_index;
+    int index = first;
+
+    gmac->tx_packets[first] = packet;
+    gmac->tx_buffer_counts[first] = buffer_count;
+
+    // Link in the new packets. The first descriptor is handed over last, so that the GMAC never sees
+    // a partially built frame.
+    for (NetworkPacket* it = packet; it; it = it->next) {
+        volatile TxDescriptor* descriptor = &gmac->tx_descriptors[index];
+
+        descriptor->address = (u32)&it->data[it->index];
+        descriptor->length = it->length;
+        descriptor->last_buffer = (it->next == 0);
+        descriptor->ignore_crc = 0;
 
-    // Link in the new packet.
-    descriptor->address = (u32)&packet->data[packet->index];
-    descriptor->length = packet->length;
-    descriptor->last_buffer = 1;
-    descriptor->ignore_crc = 0;
-    descriptor->owner = OWNER_GMAC;
+        if (index != first) {
+            descriptor->owner = OWNER_GMAC;
+        }
 
-    if (++tx_index == TRANSMIT_DESCRIPTOR_COUNT) {
-        tx_index = 0;
+        index = next_tx_index(index);
     }
 
-    // Start transmission if not already started. 
-    GMAC->NCR |= 1 << 9;
+    gmac->tx_descriptors[first].owner = OWNER_GMAC;
+
+    gmac->tx_index = index;
+    gmac->tx_used_count += buffer_count;
+    gmac->tx_pending_count++;
+    return true;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-NetworkPacket* gmac_receive() {
-    volatile RxDescriptor* descriptor = &rx_descriptors[rx_index];
+// Frames reclaimed here count as free, so a sender which waits for room does not need a flush first.
+bool gmac_can_send(NetworkStack* stack, NetworkPacket** packets, int count) {
+    Gmac* gmac = stack->driver;
+
+    reclaim_transmitted(stack);
+
+    int buffer_count = 0;
 
-    if (descriptor->owner == OWNER_GMAC) {
-        return 0;
+    for (int i = 0; i < count; i++) {
+        for (NetworkPacket* it = packets[i]; it; it = it->next) {
+            buffer_count++;
+        }
     }
 
-    // If the MTU is bigger than the configured NetworkPacket buffer size, the packet is split by the
-    // GMAC. In this case we drop the packet.
-    if (descriptor->start_of_frame == 0 || descriptor->end_of_frame == 0) {
-        descriptor->owner = OWNER_GMAC;
-        return 0;
+    // Same as gmac_send. Make sure the queued frames are being sent, so the room shows up.
+    if (buffer_count > TRANSMIT_DESCRIPTOR_COUNT - gmac->tx_used_count) {
+        gmac_flush(stack);
+        return false;
     }
 
-    NetworkPacket* packet = rx_packets[rx_index];
-    
-    packet->length = descriptor->length;
-    packet->index = 0;
-    packet->broadcast = descriptor->broadcast_detected;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
 
-    // Link in a new packet.
-    rx_packets[rx_index] = allocate_network_packet();
-    descriptor->address = (u32)rx_packets[rx_index]->data >> 2;
-    descriptor->owner = OWNER_GMAC;
+void gmac_flush(NetworkStack* stack) {
+    Gmac* gmac = stack->driver;
 
-    if (++rx_index == RECEIVE_DESCRIPTOR_COUNT) {
-        rx_index = 0;
+    if (gmac->tx_pending_count) {
+        // Start transmission if not already started. The GMAC runs through the ring until it finds a
+        // descriptor it does not own, so one write covers every frame queued since the last flush.
+        GMAC->NCR |= 1 << 9;
+        gmac->tx_pending_count = 0;
     }
 
-    return packet;
+    reclaim_transmitted(stack);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int next_rx_index(int index) {
+    return (index + 1 == RECEIVE_DESCRIPTOR_COUNT) ? 0 : index + 1;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Gives the descriptors from the current one up to, but not including, end back to the GMAC with the
+// same buffers. Used to drop frames.
+static void recycle_rx_descriptors(Gmac* gmac, int end) {
+    do {
+        gmac->rx_descriptors[gmac->rx_index].owner = OWNER_GMAC;
+        gmac->rx_index = next_rx_index(gmac->rx_index);
+    } while (gmac->rx_index != end);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The GMAC drops frames with a bad checksum when RX checksum offloading is enabled. The status says
+// which checksums it checked: 1 is the IP header, 2 adds TCP and 3 adds UDP.
+static u8 checksum_status_to_flags(int checksum_status) {
+    if (checksum_status == 3) {
+        return NETWORK_CHECKSUM_IP | NETWORK_CHECKSUM_UDP;
+    }
+
+    if (checksum_status) {
+        return NETWORK_CHECKSUM_IP;
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Frames bigger than NETWORK_PACKET_SIZE are split over several descriptors by the GMAC. These are
+// returned as a chain of packets, one per descriptor.
+int gmac_receive_burst(NetworkStack* stack, NetworkPacket** packets, int count) {
+    Gmac* gmac = stack->driver;
+    int received = 0;
+
+    while (received < count) {
+        volatile RxDescriptor* descriptor = &gmac->rx_descriptors[gmac->rx_index];
+
+        if (descriptor->owner == OWNER_GMAC) {
+            break;
+        }
+
+        // Left over from a frame the GMAC gave up on. Skip it, otherwise the ring stalls on a slot
+        // the GMAC has already moved past.
+        if (descriptor->start_of_frame == 0) {
+            recycle_rx_descriptors(gmac, next_rx_index(gmac->rx_index));
+            continue;
+        }
+
+        // Find the last descriptor of the frame. Stop if the GMAC is still writing it.
+        int last = gmac->rx_index;
+        int buffer_count = 1;
+        bool truncated = false;
+
+        while (gmac->rx_descriptors[last].end_of_frame == 0) {
+            int next = next_rx_index(last);
+
+            if (gmac->rx_descriptors[next].owner == OWNER_GMAC) {
+                return received;
+            }
+
+            if (gmac->rx_descriptors[next].start_of_frame || next == gmac->rx_index) {
+                truncated = true;
+                break;
+            }
+
+            last = next;
+            buffer_count++;
+        }
+
+        // The length is the length of the whole frame, and it is only valid in the last descriptor.
+        // The same goes for the checksum status.
+        int frame_length = gmac->rx_descriptors[last].length;
+        int checksum_status = gmac->rx_descriptors[last].checksum_status;
+
+        if (truncated || frame_length <= (buffer_count - 1) * NETWORK_PACKET_SIZE) {
+            recycle_rx_descriptors(gmac, next_rx_index(last));
+            continue;
+        }
+
+        // The filter looks at the first buffer and the address match bits. Frames it rejects go back
+        // to the GMAC right away, without touching the packet pool.
+        volatile RxDescriptor* last_descriptor = &gmac->rx_descriptors[last];
+        int flags = 0;
+
+        if (last_descriptor->broadcast_detected) {
+            flags |= FILTER_FLAG_BROADCAST;
+        }
+
+        if (last_descriptor->multicast_hash_match) {
+            flags |= FILTER_FLAG_MULTICAST;
+        }
+
+        if (last_descriptor->address_match) {
+            flags |= FILTER_FLAG_OUR_MAC;
+        }
+
+        const u8* data = (const u8 *)gmac->rx_packets[gmac->rx_index]->data;
+
+        if (filter_accept(stack, data, limit(frame_length, NETWORK_PACKET_SIZE), frame_length, flags) == false) {
+            recycle_rx_descriptors(gmac, next_rx_index(last));
+            continue;
+        }
+
+        // Get new buffers for all the descriptors before taking the old ones. If the packet pool is
+        // exhausted, drop the frame and give the same buffers back to the GMAC, so the ring never
+        // runs dry.
+        NetworkPacket* replacements = 0;
+        int replacement_count = 0;
+
+        for (; replacement_count < buffer_count; replacement_count++) {
+            NetworkPacket* replacement = allocate_reserved_network_packet(stack, NETWORK_RX_PACKET_SIZE);
+
+            if (replacement == 0) {
+                break;
+            }
+
+            replacement->next = replacements;
+            replacements = replacement;
+        }
+
+        if (replacement_count != buffer_count) {
+            free_network_packet(stack, replacements);
+            recycle_rx_descriptors(gmac, next_rx_index(last));
+            continue;
+        }
+
+        NetworkPacket* head = 0;
+        NetworkPacket* tail = 0;
+
+        for (int i = 0; i < buffer_count; i++) {
+            descriptor = &gmac->rx_descriptors[gmac->rx_index];
+
+            NetworkPacket* packet = gmac->rx_packets[gmac->rx_index];
+            packet->index = 0;
+            packet->length = (i == buffer_count - 1) ? frame_length - i * NETWORK_PACKET_SIZE : NETWORK_PACKET_SIZE;
+            packet->next = 0;
+
+            if (tail) {
+                tail->next = packet;
+            }
+            else {
+                head = packet;
+            }
+
+            tail = packet;
+
+            // Link in a new packet.
+            NetworkPacket* replacement = replacements;
+            replacements = replacement->next;
+            replacement->next = 0;
+
+            gmac->rx_packets[gmac->rx_index] = replacement;
+            descriptor->address = (u32)replacement->data >> 2;
+            descriptor->owner = OWNER_GMAC;
+
+            gmac->rx_index = next_rx_index(gmac->rx_index);
+        }
+
+        // The descriptors belong to the GMAC again, so the address match bits are taken from the flags.
+        // @Verify that the address match bits are valid in the last descriptor of a split frame.
+        head->broadcast = (flags & FILTER_FLAG_BROADCAST) != 0;
+        head->multicast = (flags & FILTER_FLAG_MULTICAST) != 0;
+        head->checksum_verified = checksum_status_to_flags(checksum_status);
+        packets[received++] = head;
+    }
+
+    return received;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+NetworkPacket* gmac_receive(NetworkStack* stack) {
+    NetworkPacket* packet;
+    return (gmac_receive_burst(stack, &packet, 1)) ? packet : 0;
 }
@@ -8,15 +8,37 @@
 
 //--------------------------------------------------------------------------------------------------
 
+// The TX ring holds all the fragments of a datagram of IP_MAX_DATAGRAM_SIZE, which are queued together.
 #define RECEIVE_DESCRIPTOR_COUNT   32
-#define TRANSMIT_DESCRIPTOR_COUNT  8
+#define TRANSMIT_DESCRIPTOR_COUNT  32
+
+// Size hint used for the RX buffers. It selects packets which can hold NETWORK_PACKET_SIZE bytes.
+#define NETWORK_RX_PACKET_SIZE  NETWORK_PACKET_USER_SIZE
 
 //--------------------------------------------------------------------------------------------------
 
-void gmac_init();
-void gmac_deinit();
-void gmac_set_mac_address(const Mac* mac);
-void gmac_send(NetworkPacket* packet);
-NetworkPacket* gmac_receive();
+// Each stack gets its own driver instance. The driver keeps its state in stack->driver.
+void gmac_init(NetworkStack* stack);
+void gmac_deinit(NetworkStack* stack);
+void gmac_set_mac_address(NetworkStack* stack, const Mac* mac);
+
+// Replaces the multicast MACs whose frames are received. Broadcast frames always are. The filter may
+// be inexact, so frames to other groups can get through as well.
+void gmac_set_multicast_filter(NetworkStack* stack, const Mac* macs, int count);
+
+// Queues a frame on the TX ring without starting the transmitter. Returns false if the ring is full,
+// in which case the caller keeps the packet. Otherwise the driver frees it once it has been sent.
+bool gmac_send(NetworkStack* stack, NetworkPacket* packet);
+
+// Returns true if gmac_send would take all the frames right now, in order.
+bool gmac_can_send(NetworkStack* stack, NetworkPacket** packets, int count);
+
+// Starts transmission of all queued frames and reclaims the buffers of the frames already sent.
+void gmac_flush(NetworkStack* stack);
+
+NetworkPacket* gmac_receive(NetworkStack* stack);
+
+// Takes up to count received frames from the RX ring. Returns the number of frames stored in packets.
+int gmac_receive_burst(NetworkStack* stack, NetworkPacket** packets, int count);
 
 #endif
@@ -0,0 +1,428 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+// Host implementation of the GMAC driver interface backed by an AF_PACKET socket with memory mapped
+// TPACKET_V3 RX and TX rings. Received frames are picked straight out of the shared ring and queued
+// frames are handed to the kernel with a single doorbell per batch, so there is no syscall per frame.
+// Intended for load testing against a veth pair. When several stacks are attached to the same interface
+// each socket sees every frame, and each stack keeps the ones sent to its own MAC.
+
+#include "gmac.h"
+#include "stack.h"
+#include "filter.h"
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+//--------------------------------------------------------------------------------------------------
+
+#ifndef PACKET_INTERFACE_NAME
+#define PACKET_INTERFACE_NAME "veth0"
+#endif
+
+#define PACKET_RING_FRAME_SIZE       2048
+#define PACKET_RX_RING_BLOCK_SIZE    (1 << 20)
+#define PACKET_RX_RING_BLOCK_COUNT   32
+#define PACKET_TX_RING_BLOCK_SIZE    (1 << 20)
+#define PACKET_TX_RING_BLOCK_COUNT   8
+
+// How long the kernel keeps a partially filled RX block before handing it to us.
+#define PACKET_RX_BLOCK_TIMEOUT_MS  1
+
+// Number of queued TX frames after which the kernel is kicked without waiting for the next poll.
+#define PACKET_TX_BATCH_SIZE  64
+
+#define PACKET_TX_FRAME_COUNT  (PACKET_TX_RING_BLOCK_SIZE / PACKET_RING_FRAME_SIZE * PACKET_TX_RING_BLOCK_COUNT)
+#define PACKET_TX_DATA_OFFSET  TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+#define PACKET_SOCKET_COUNT  8
+
+//--------------------------------------------------------------------------------------------------
+
+typedef struct {
+    int fd;
+
+    u8* ring;
+    int ring_size;
+
+    u8* rx_ring;
+    u8* tx_ring;
+
+    // Current RX block and the next frame within it.
+    int rx_block_index;
+    int rx_frames_left;
+    struct tpacket3_hdr* rx_frame;
+
+    int tx_frame_index;
+    int tx_pending_count;
+
+    NetworkPacket* rx_packets[RECEIVE_DESCRIPTOR_COUNT];
+    int rx_index;
+} PacketSocket;
+
+//--------------------------------------------------------------------------------------------------
+
+static PacketSocket packet_sockets[PACKET_SOCKET_COUNT];
+static int packet_socket_count;
+
+//--------------------------------------------------------------------------------------------------
+
+static void set_socket_option(PacketSocket* packet_socket, int level, int option, const void* value, int size) {
+    if (setsockopt(packet_socket->fd, level, option, value, size) < 0) {
+        while (1);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_init(NetworkStack* stack) {
+    if (packet_socket_count == PACKET_SOCKET_COUNT) {
+        while (1);
+    }
+
+    PacketSocket* packet_socket = &packet_sockets[packet_socket_count++];
+    stack->driver = packet_socket;
+
+    // Requires CAP_NET_RAW.
+    packet_socket->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+
+    if (packet_socket->fd < 0) {
+        while (1);
+    }
+
+    int version = TPACKET_V3;
+    set_socket_option(packet_socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version));
+
+    // Skip the kernel traffic control layer on transmit.
+    int bypass = 1;
+    set_socket_option(packet_socket, SOL_PACKET, PACKET_QDISC_BYPASS, &bypass, sizeof(bypass));
+
+    struct tpacket_req3 rx_request = {
+        .tp_block_size      = PACKET_RX_RING_BLOCK_SIZE,
+        .tp_block_nr        = PACKET_RX_RING_BLOCK_COUNT,
+        .tp_frame_size      = PACKET_RING_FRAME_SIZE,
+        .tp_frame_nr        = PACKET_RX_RING_BLOCK_SIZE / PACKET_RING_FRAME_SIZE * PACKET_RX_RING_BLOCK_COUNT,
+        .tp_retire_blk_tov  = PACKET_RX_BLOCK_TIMEOUT_MS,
+    };
+
+    // The kernel rejects a TX ring with any of the block retire fields set.
+    struct tpacket_req3 tx_request = {
+        .tp_block_size      = PACKET_TX_RING_BLOCK_SIZE,
+        .tp_block_nr        = PACKET_TX_RING_BLOCK_COUNT,
+        .tp_frame_size      = PACKET_RING_FRAME_SIZE,
+        .tp_frame_nr        = PACKET_TX_FRAME_COUNT,
+    };
+
+    set_socket_option(packet_socket, SOL_PACKET, PACKET_RX_RING, &rx_request, sizeof(rx_request));
+    set_socket_option(packet_socket, SOL_PACKET, PACKET_TX_RING, &tx_request, sizeof(tx_request));
+
+    // Both rings are mapped in one go. The TX ring follows directly after the RX ring.
+    int rx_ring_size = PACKET_RX_RING_BLOCK_SIZE * PACKET_RX_RING_BLOCK_COUNT;
+    int tx_ring_size = PACKET_TX_RING_BLOCK_SIZE * PACKET_TX_RING_BLOCK_COUNT;
+
+    packet_socket->ring_size = rx_ring_size + tx_ring_size;
+    packet_socket->ring = mmap(0, packet_socket->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, packet_socket->fd, 0);
+
+    if (packet_socket->ring == MAP_FAILED) {
+        while (1);
+    }
+
+    packet_socket->rx_ring = packet_socket->ring;
+    packet_socket->tx_ring = packet_socket->ring + rx_ring_size;
+
+    int interface_index = if_nametoindex(PACKET_INTERFACE_NAME);
+
+    if (interface_index == 0) {
+        while (1);
+    }
+
+    struct sockaddr_ll address = {
+        .sll_family   = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+        .sll_ifindex  = interface_index,
+    };
+
+    if (bind(packet_socket->fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        while (1);
+    }
+
+    // Our MAC address is not the one of the host interface, so we need to see every frame.
+    struct packet_mreq membership = {
+        .mr_ifindex = interface_index,
+        .mr_type    = PACKET_MR_PROMISC,
+    };
+
+    set_socket_option(packet_socket, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &membership, sizeof(membership));
+
+    for (int i = 0; i < RECEIVE_DESCRIPTOR_COUNT; i++) {
+        packet_socket->rx_packets[i] = allocate_reserved_network_packet(stack, NETWORK_RX_PACKET_SIZE);
+    }
+
+    packet_socket->rx_index = 0;
+    packet_socket->rx_block_index = 0;
+    packet_socket->rx_frames_left = 0;
+    packet_socket->rx_frame = 0;
+
+    packet_socket->tx_frame_index = 0;
+    packet_socket->tx_pending_count = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_deinit(NetworkStack* stack) {
+    PacketSocket* packet_socket = stack->driver;
+
+    munmap(packet_socket->ring, packet_socket->ring_size);
+    close(packet_socket->fd);
+    packet_socket->fd = -1;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_set_mac_address(NetworkStack* stack, const Mac* mac) {
+    // The socket is in promiscuous mode and the stack does the destination filtering.
+    (void)stack;
+    (void)mac;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_set_multicast_filter(NetworkStack* stack, const Mac* macs, int count) {
+    // Same as the MAC address. Promiscuous mode passes every group to the stack.
+    (void)stack;
+    (void)macs;
+    (void)count;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void kick_transmitter(PacketSocket* packet_socket) {
+    if (packet_socket->tx_pending_count) {
+        send(packet_socket->fd, 0, 0, MSG_DONTWAIT);
+        packet_socket->tx_pending_count = 0;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool gmac_send(NetworkStack* stack, NetworkPacket* packet) {
+    PacketSocket* packet_socket = stack->driver;
+    struct tpacket3_hdr* header = (struct tpacket3_hdr *)(packet_socket->tx_ring + packet_socket->tx_frame_index * PACKET_RING_FRAME_SIZE);
+
+    int length = get_network_packet_length(packet);
+
+    // The frame can never fit in a ring slot. Drop it like the link would.
+    if (length > PACKET_RING_FRAME_SIZE - (int)PACKET_TX_DATA_OFFSET) {
+        free_network_packet(stack, packet);
+        return true;
+    }
+
+    // Network saturation. The caller still owns the packet.
+    if (header->tp_status != TP_STATUS_AVAILABLE) {
+        kick_transmitter(packet_socket);
+        return false;
+    }
+
+    copy_from_network_packet(packet, 0, (u8 *)header + PACKET_TX_DATA_OFFSET, length);
+    header->tp_len = length;
+    header->tp_next_offset = 0;
+
+    __atomic_store_n(&header->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    free_network_packet(stack, packet);
+
+    if (++packet_socket->tx_frame_index == PACKET_TX_FRAME_COUNT) {
+        packet_socket->tx_frame_index = 0;
+    }
+
+    // The doorbell is normally rung from gmac_flush at the end of network_task. Bulk senders get an
+    // extra one every PACKET_TX_BATCH_SIZE frames so the kernel can start on the ring early.
+    if (++packet_socket->tx_pending_count == PACKET_TX_BATCH_SIZE) {
+        kick_transmitter(packet_socket);
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool gmac_can_send(NetworkStack* stack, NetworkPacket** packets, int count) {
+    (void)packets;
+    PacketSocket* packet_socket = stack->driver;
+
+    if (count > PACKET_TX_FRAME_COUNT) {
+        return false;
+    }
+
+    // The kernel hands the slots back in ring order, so the last one we need is the last to be free.
+    int index = (packet_socket->tx_frame_index + count - 1) % PACKET_TX_FRAME_COUNT;
+    struct tpacket3_hdr* header = (struct tpacket3_hdr *)(packet_socket->tx_ring + index * PACKET_RING_FRAME_SIZE);
+
+    if (count && __atomic_load_n(&header->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+        kick_transmitter(packet_socket);
+        return false;
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_flush(NetworkStack* stack) {
+    kick_transmitter(stack->driver);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static struct tpacket_block_desc* get_rx_block(PacketSocket* packet_socket) {
+    return (struct tpacket_block_desc *)(packet_socket->rx_ring + packet_socket->rx_block_index * PACKET_RX_RING_BLOCK_SIZE);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void release_rx_block(PacketSocket* packet_socket) {
+    struct tpacket_block_desc* block = get_rx_block(packet_socket);
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+
+    if (++packet_socket->rx_block_index == PACKET_RX_RING_BLOCK_COUNT) {
+        packet_socket->rx_block_index = 0;
+    }
+
+    packet_socket->rx_frame = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns the next frame in the RX ring, or zero if the kernel has not retired any new blocks.
+static struct tpacket3_hdr* next_rx_frame(PacketSocket* packet_socket) {
+    if (packet_socket->rx_frame && packet_socket->rx_frames_left == 0) {
+        release_rx_block(packet_socket);
+    }
+
+    if (packet_socket->rx_frame == 0) {
+        struct tpacket_block_desc* block = get_rx_block(packet_socket);
+
+        if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+            return 0;
+        }
+
+        packet_socket->rx_frames_left = block->hdr.bh1.num_pkts;
+        packet_socket->rx_frame = (struct tpacket3_hdr *)((u8 *)block + block->hdr.bh1.offset_to_first_pkt);
+
+        if (packet_socket->rx_frames_left == 0) {
+            release_rx_block(packet_socket);
+            return 0;
+        }
+
+        packet_socket->rx_frames_left--;
+        return packet_socket->rx_frame;
+    }
+
+    packet_socket->rx_frames_left--;
+    packet_socket->rx_frame = (struct tpacket3_hdr *)((u8 *)packet_socket->rx_frame + packet_socket->rx_frame->tp_next_offset);
+    return packet_socket->rx_frame;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static NetworkPacket* receive_frame(NetworkStack* stack) {
+    PacketSocket* packet_socket = stack->driver;
+
+    while (1) {
+        struct tpacket3_hdr* frame = next_rx_frame(packet_socket);
+
+        if (frame == 0) {
+            return 0;
+        }
+
+        struct sockaddr_ll* address = (struct sockaddr_ll *)((u8 *)frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+        // The socket also sees the frames we transmit ourselves.
+        if (address->sll_pkttype == PACKET_OUTGOING) {
+            continue;
+        }
+
+        // Same as the GMAC. Frames bigger than the maximum frame size are dropped.
+        if (frame->tp_snaplen > NETWORK_MAX_FRAME_SIZE || frame->tp_snaplen != frame->tp_len) {
+            continue;
+        }
+
+        const u8* data = (u8 *)frame + frame->tp_mac;
+        int flags = filter_get_flags(stack, data, frame->tp_snaplen);
+
+        // The socket is promiscuous. Same as the address filter of the GMAC, unicast frames for other
+        // MACs are dropped, which includes those for the other stacks on the interface.
+        if (flags == 0) {
+            continue;
+        }
+
+        if (filter_accept(stack, data, frame->tp_snaplen, frame->tp_snaplen, flags) == false) {
+            continue;
+        }
+
+        // The packet pool is exhausted. Drop the frame and keep the buffer in the ring.
+        NetworkPacket* replacement = allocate_reserved_network_packet(stack, NETWORK_RX_PACKET_SIZE);
+
+        if (replacement == 0) {
+            continue;
+        }
+
+        NetworkPacket* packet = packet_socket->rx_packets[packet_socket->rx_index];
+        packet->index = 0;
+        packet->length = 0;
+
+        // Frames bigger than the packet buffer continue in a chain.
+        if (append_to_network_packet(stack, packet, (u8 *)frame + frame->tp_mac, frame->tp_snaplen, true) == false) {
+            free_network_packet(stack, packet->next);
+            free_network_packet(stack, replacement);
+            packet->next = 0;
+            continue;
+        }
+
+        packet->broadcast = address->sll_pkttype == PACKET_BROADCAST;
+        packet->multicast = address->sll_pkttype == PACKET_MULTICAST;
+
+        // The kernel only vouches for the transport checksum. CSUMNOTREADY is set for frames from a
+        // local sender whose checksum was never filled in, so they would fail a software check.
+        packet->checksum_verified = 0;
+
+        if (frame->tp_status & (TP_STATUS_CSUM_VALID | TP_STATUS_CSUMNOTREADY)) {
+            packet->checksum_verified = NETWORK_CHECKSUM_UDP;
+        }
+
+        // Link in a new packet.
+        packet_socket->rx_packets[packet_socket->rx_index] = replacement;
+
+        if (++packet_socket->rx_index == RECEIVE_DESCRIPTOR_COUNT) {
+            packet_socket->rx_index = 0;
+        }
+
+        return packet;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int gmac_receive_burst(NetworkStack* stack, NetworkPacket** packets, int count) {
+    int received = 0;
+
+    while (received < count) {
+        NetworkPacket* packet = receive_frame(stack);
+
+        if (packet == 0) {
+            break;
+        }
+
+        packets[received++] = packet;
+    }
+
+    return received;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+NetworkPacket* gmac_receive(NetworkStack* stack) {
+    return receive_frame(stack);
+}
@@ -0,0 +1,363 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+// Host implementation of the GMAC driver interface which feeds the stack from a pcap file and records
+// everything the stack sends to another pcap file. No network or privileges are needed, so this is used
+// to get reproducible throughput numbers. Frames are replayed as fast as possible, or at the captured
+// timestamps if PCAP_REPLAY_REALTIME is set. There is only one capture, so only one stack can be
+// attached.
+
+#include "gmac.h"
+#include "stack.h"
+#include "filter.h"
+#include "pcap_replay.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+//--------------------------------------------------------------------------------------------------
+
+#ifndef PCAP_INPUT_FILE
+#define PCAP_INPUT_FILE "input.pcap"
+#endif
+
+#ifndef PCAP_OUTPUT_FILE
+#define PCAP_OUTPUT_FILE "output.pcap"
+#endif
+
+#ifndef PCAP_REPLAY_REALTIME
+#define PCAP_REPLAY_REALTIME 0
+#endif
+
+#define PCAP_MAGIC_MICROSECONDS  0xA1B2C3D4
+#define PCAP_MAGIC_NANOSECONDS   0xA1B23C4D
+#define PCAP_LINK_TYPE_ETHERNET  1
+#define PCAP_SNAPSHOT_LENGTH     65535
+
+//--------------------------------------------------------------------------------------------------
+
+typedef struct {
+    u32 magic;
+    u16 version_major;
+    u16 version_minor;
+    s32 time_zone;
+    u32 time_accuracy;
+    u32 snapshot_length;
+    u32 link_type;
+} PcapFileHeader;
+
+typedef struct {
+    u32 seconds;
+    u32 fraction;
+    u32 captured_length;
+    u32 original_length;
+} PcapRecordHeader;
+
+//--------------------------------------------------------------------------------------------------
+
+static u8* input;
+static int input_size;
+static int input_offset;
+
+static bool swapped;
+static u32 fraction_per_second;
+static bool done;
+
+// Replay clock. The first record is aligned with the time of the first receive.
+static u64 start_ns;
+static u64 first_record_ns;
+static bool started;
+
+static FILE* output;
+
+static PcapStatistics statistics;
+
+static NetworkPacket* rx_packets[RECEIVE_DESCRIPTOR_COUNT];
+static int rx_index;
+
+//--------------------------------------------------------------------------------------------------
+
+static u64 get_time_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u32 read_u32(const u32* pointer) {
+    u32 value = *pointer;
+    return (swapped) ? __builtin_bswap32(value) : value;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_init(NetworkStack* stack) {
+    int fd = open(PCAP_INPUT_FILE, O_RDONLY);
+
+    if (fd < 0) {
+        while (1);
+    }
+
+    struct stat file_status;
+    fstat(fd, &file_status);
+    input_size = file_status.st_size;
+
+    if (input_size < (int)sizeof(PcapFileHeader)) {
+        while (1);
+    }
+
+    // The whole capture is mapped up front so that replay does not do any file IO.
+    input = mmap(0, input_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+
+    if (input == MAP_FAILED) {
+        while (1);
+    }
+
+    const PcapFileHeader* header = (const PcapFileHeader *)input;
+    u32 magic = header->magic;
+
+    swapped = (magic == __builtin_bswap32(PCAP_MAGIC_MICROSECONDS) || magic == __builtin_bswap32(PCAP_MAGIC_NANOSECONDS));
+    magic = read_u32(&header->magic);
+
+    if (magic == PCAP_MAGIC_MICROSECONDS) {
+        fraction_per_second = 1000000;
+    }
+    else if (magic == PCAP_MAGIC_NANOSECONDS) {
+        fraction_per_second = 1000000000;
+    }
+    else {
+        while (1);
+    }
+
+    if (read_u32(&header->link_type) != PCAP_LINK_TYPE_ETHERNET) {
+        while (1);
+    }
+
+    input_offset = sizeof(PcapFileHeader);
+    done = false;
+    started = false;
+
+    output = fopen(PCAP_OUTPUT_FILE, "wb");
+
+    if (output == 0) {
+        while (1);
+    }
+
+    const PcapFileHeader output_header = {
+        .magic           = PCAP_MAGIC_NANOSECONDS,
+        .version_major   = 2,
+        .version_minor   = 4,
+        .snapshot_length = PCAP_SNAPSHOT_LENGTH,
+        .link_type       = PCAP_LINK_TYPE_ETHERNET,
+    };
+
+    fwrite(&output_header, sizeof(output_header), 1, output);
+
+    memory_fill(&statistics, 0, sizeof(statistics));
+
+    for (int i = 0; i < RECEIVE_DESCRIPTOR_COUNT; i++) {
+        rx_packets[i] = allocate_reserved_network_packet(stack, NETWORK_RX_PACKET_SIZE);
+    }
+
+    rx_index = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_deinit(NetworkStack* stack) {
+    (void)stack;
+    munmap(input, input_size);
+    fclose(output);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_set_mac_address(NetworkStack* stack, const Mac* mac) {
+    (void)stack;
+    (void)mac;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The capture is replayed as it is, and the stack drops the frames of groups it has not joined.
+void gmac_set_multicast_filter(NetworkStack* stack, const Mac* macs, int count) {
+    (void)stack;
+    (void)macs;
+    (void)count;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool gmac_send(NetworkStack* stack, NetworkPacket* packet) {
+    u64 time = get_time_ns();
+    int length = get_network_packet_length(packet);
+
+    PcapRecordHeader header = {
+        .seconds         = time / 1000000000,
+        .fraction        = time % 1000000000,
+        .captured_length = length,
+        .original_length = length,
+    };
+
+    fwrite(&header, sizeof(header), 1, output);
+
+    for (NetworkPacket* it = packet; it; it = it->next) {
+        fwrite((u8 *)&it->data[it->index], it->length, 1, output);
+    }
+
+    statistics.sent_count++;
+    statistics.sent_bytes += length;
+
+    free_network_packet(stack, packet);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool gmac_can_send(NetworkStack* stack, NetworkPacket** packets, int count) {
+    (void)stack;
+    (void)packets;
+    (void)count;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Frames are written to the output file as they are sent.
+void gmac_flush(NetworkStack* stack) {
+    (void)stack;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void finish_replay() {
+    done = true;
+    statistics.elapsed_ns = (started) ? get_time_ns() - start_ns : 0;
+    fflush(output);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static NetworkPacket* receive_frame(NetworkStack* stack) {
+    while (done == false) {
+        if (input_offset + (int)sizeof(PcapRecordHeader) > input_size) {
+            finish_replay();
+            break;
+        }
+
+        const PcapRecordHeader* header = (const PcapRecordHeader *)&input[input_offset];
+        u32 captured_length = read_u32(&header->captured_length);
+        u32 original_length = read_u32(&header->original_length);
+
+        if (captured_length > (u32)(input_size - input_offset - (int)sizeof(PcapRecordHeader))) {
+            finish_replay();
+            break;
+        }
+
+        u64 record_ns = (u64)read_u32(&header->seconds) * 1000000000 + (u64)read_u32(&header->fraction) * (1000000000 / fraction_per_second);
+
+        if (started == false) {
+            started = true;
+            start_ns = get_time_ns();
+            first_record_ns = record_ns;
+        }
+
+        if (PCAP_REPLAY_REALTIME && get_time_ns() - start_ns < record_ns - first_record_ns) {
+            break;
+        }
+
+        const u8* frame = &input[input_offset + sizeof(PcapRecordHeader)];
+        input_offset += sizeof(PcapRecordHeader) + captured_length;
+
+        // Same as the GMAC. Frames bigger than the maximum frame size are dropped. So are frames which
+        // were truncated by the capture.
+        if (captured_length > NETWORK_MAX_FRAME_SIZE || captured_length != original_length) {
+            statistics.dropped_count++;
+            continue;
+        }
+
+        if (filter_accept(stack, frame, captured_length, captured_length, filter_get_flags(stack, frame, captured_length)) == false) {
+            statistics.dropped_count++;
+            continue;
+        }
+
+        // The packet pool is exhausted. Drop the frame and keep the buffer in the ring.
+        NetworkPacket* replacement = allocate_reserved_network_packet(stack, NETWORK_RX_PACKET_SIZE);
+
+        if (replacement == 0) {
+            statistics.dropped_count++;
+            continue;
+        }
+
+        NetworkPacket* packet = rx_packets[rx_index];
+        packet->index = 0;
+        packet->length = 0;
+
+        // Frames bigger than the packet buffer continue in a chain.
+        if (append_to_network_packet(stack, packet, frame, captured_length, true) == false) {
+            free_network_packet(stack, packet->next);
+            free_network_packet(stack, replacement);
+            packet->next = 0;
+            statistics.dropped_count++;
+            continue;
+        }
+
+        const Mac broadcast = { .address = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } };
+        packet->broadcast = memory_compare(frame, &broadcast, sizeof(Mac));
+        packet->multicast = (frame[0] & 1) && packet->broadcast == false;
+
+        statistics.received_count++;
+        statistics.received_bytes += captured_length;
+
+        // Link in a new packet.
+        rx_packets[rx_index] = replacement;
+
+        if (++rx_index == RECEIVE_DESCRIPTOR_COUNT) {
+            rx_index = 0;
+        }
+
+        return packet;
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool pcap_replay_is_done() {
+    return done;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+const PcapStatistics* pcap_get_statistics() {
+    return &statistics;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int gmac_receive_burst(NetworkStack* stack, NetworkPacket** packets, int count) {
+    int received = 0;
+
+    while (received < count) {
+        NetworkPacket* packet = receive_frame(stack);
+
+        if (packet == 0) {
+            break;
+        }
+
+        packets[received++] = packet;
+    }
+
+    return received;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+NetworkPacket* gmac_receive(NetworkStack* stack) {
+    return receive_frame(stack);
+}
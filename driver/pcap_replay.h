@@ -0,0 +1,26 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+#ifndef PCAP_REPLAY_H
+#define PCAP_REPLAY_H
+
+#include "utilities.h"
+
+//--------------------------------------------------------------------------------------------------
+
+typedef struct {
+    u64 received_count;
+    u64 received_bytes;
+    u64 dropped_count;
+    u64 sent_count;
+    u64 sent_bytes;
+
+    // Time from the first frame was handed to the stack until the input ran out.
+    u64 elapsed_ns;
+} PcapStatistics;
+
+//--------------------------------------------------------------------------------------------------
+
+bool pcap_replay_is_done();
+const PcapStatistics* pcap_get_statistics();
+
+#endif
@@ -0,0 +1,253 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+// Host implementation of the GMAC driver interface backed by a Linux TAP device. This lets the stack
+// run as a normal process, which is handy for profiling. The RX ring is kept so that the buffer
+// ownership is the same as on the target. The kernel copies the frame on write, so TX buffers are
+// reclaimed right away.
+
+#include "gmac.h"
+#include "stack.h"
+#include "filter.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+//--------------------------------------------------------------------------------------------------
+
+// Stack number N is attached to the TAP device named TAP_INTERFACE_PREFIX followed by N.
+#ifndef TAP_INTERFACE_PREFIX
+#define TAP_INTERFACE_PREFIX "tap"
+#endif
+
+#define TAP_DEVICE_COUNT 8
+
+// Longest packet chain sent with a single writev.
+#define TAP_MAX_VECTOR_COUNT 16
+
+//--------------------------------------------------------------------------------------------------
+
+typedef struct {
+    int fd;
+
+    NetworkPacket* rx_packets[RECEIVE_DESCRIPTOR_COUNT];
+    int rx_index;
+
+    // Receives the part of a frame that does not fit in the RX packet. The extra byte tells us if the
+    // frame was bigger than the maximum frame size.
+    u8 overflow[NETWORK_MAX_FRAME_SIZE - NETWORK_PACKET_SIZE + 1];
+} TapDevice;
+
+//--------------------------------------------------------------------------------------------------
+
+static TapDevice tap_devices[TAP_DEVICE_COUNT];
+static int tap_device_count;
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_init(NetworkStack* stack) {
+    if (tap_device_count == TAP_DEVICE_COUNT) {
+        while (1);
+    }
+
+    int number = tap_device_count;
+    TapDevice* tap = &tap_devices[tap_device_count++];
+    stack->driver = tap;
+
+    tap->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+
+    // The process needs CAP_NET_ADMIN, or the TAP device must be created in advance and owned by the
+    // user (ip tuntap add dev tap0 mode tap user $USER).
+    if (tap->fd < 0) {
+        while (1);
+    }
+
+    struct ifreq request;
+    memory_fill(&request, 0, sizeof(request));
+    memory_copy(TAP_INTERFACE_PREFIX, request.ifr_name, sizeof(TAP_INTERFACE_PREFIX) - 1);
+    request.ifr_name[sizeof(TAP_INTERFACE_PREFIX) - 1] = '0' + number;
+    request.ifr_flags = IFF_TAP | IFF_NO_PI;
+
+    if (ioctl(tap->fd, TUNSETIFF, &request) < 0) {
+        while (1);
+    }
+
+    for (int i = 0; i < RECEIVE_DESCRIPTOR_COUNT; i++) {
+        tap->rx_packets[i] = allocate_reserved_network_packet(stack, NETWORK_RX_PACKET_SIZE);
+    }
+
+    tap->rx_index = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_deinit(NetworkStack* stack) {
+    TapDevice* tap = stack->driver;
+    close(tap->fd);
+    tap->fd = -1;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_set_mac_address(NetworkStack* stack, const Mac* mac) {
+    // The TAP device acts like a switch port and passes every frame to us. Destination filtering is
+    // done by the stack, so there is nothing to program here.
+    (void)stack;
+    (void)mac;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Same as the MAC address. The stack drops the frames of groups it has not joined.
+void gmac_set_multicast_filter(NetworkStack* stack, const Mac* macs, int count) {
+    (void)stack;
+    (void)macs;
+    (void)count;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool gmac_send(NetworkStack* stack, NetworkPacket* packet) {
+    TapDevice* tap = stack->driver;
+    struct iovec vectors[TAP_MAX_VECTOR_COUNT];
+    int vector_count = 0;
+    int length = 0;
+
+    for (NetworkPacket* it = packet; it; it = it->next) {
+        // The chain is too long to be a valid frame. Drop it like the link would.
+        if (vector_count == TAP_MAX_VECTOR_COUNT) {
+            free_network_packet(stack, packet);
+            return true;
+        }
+
+        vectors[vector_count].iov_base = (u8 *)&it->data[it->index];
+        vectors[vector_count].iov_len = it->length;
+        vector_count++;
+        length += it->length;
+    }
+
+    int written = writev(tap->fd, vectors, vector_count);
+
+    // Network saturation. The caller still owns the packet.
+    if (written != length) {
+        return false;
+    }
+
+    free_network_packet(stack, packet);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The TAP device has no ring to run out of. The kernel drops frames when its queue is full instead.
+bool gmac_can_send(NetworkStack* stack, NetworkPacket** packets, int count) {
+    (void)stack;
+    (void)packets;
+    (void)count;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Every write is a separate system call, so there is nothing to batch.
+void gmac_flush(NetworkStack* stack) {
+    (void)stack;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static NetworkPacket* receive_frame(NetworkStack* stack) {
+    TapDevice* tap = stack->driver;
+    NetworkPacket* packet = tap->rx_packets[tap->rx_index];
+    NetworkPacket* replacement;
+    int length;
+
+    struct iovec vectors[2] = {
+        { .iov_base = (u8 *)packet->data, .iov_len = NETWORK_PACKET_SIZE },
+        { .iov_base = tap->overflow,      .iov_len = sizeof(tap->overflow) },
+    };
+
+    // Same as the GMAC. Frames bigger than a packet buffer continue in a chain. Frames bigger than
+    // the maximum frame size are dropped, and so are all frames while the packet pool is exhausted.
+    while (1) {
+        length = readv(tap->fd, vectors, 2);
+
+        if (length <= 0) {
+            return 0;
+        }
+
+        if (length > NETWORK_MAX_FRAME_SIZE) {
+            continue;
+        }
+
+        // Rejected frames leave the buffer in the ring.
+        const u8* data = (const u8 *)packet->data;
+        int data_length = limit(length, NETWORK_PACKET_SIZE);
+
+        if (filter_accept(stack, data, data_length, length, filter_get_flags(stack, data, data_length)) == false) {
+            continue;
+        }
+
+        replacement = allocate_reserved_network_packet(stack, NETWORK_RX_PACKET_SIZE);
+
+        if (replacement == 0) {
+            continue;
+        }
+
+        packet->index = 0;
+        packet->length = limit(length, NETWORK_PACKET_SIZE);
+        packet->next = 0;
+
+        if (length <= NETWORK_PACKET_SIZE) {
+            break;
+        }
+
+        if (append_to_network_packet(stack, packet, tap->overflow, length - NETWORK_PACKET_SIZE, true)) {
+            break;
+        }
+
+        free_network_packet(stack, packet->next);
+        free_network_packet(stack, replacement);
+        packet->next = 0;
+    }
+
+    const Mac broadcast = { .address = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } };
+
+    packet->broadcast = memory_compare((u8 *)packet->data, &broadcast, sizeof(Mac));
+    packet->multicast = (packet->data[0] & 1) && packet->broadcast == false;
+
+    // Link in a new packet.
+    tap->rx_packets[tap->rx_index] = replacement;
+
+    if (++tap->rx_index == RECEIVE_DESCRIPTOR_COUNT) {
+        tap->rx_index = 0;
+    }
+
+    return packet;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int gmac_receive_burst(NetworkStack* stack, NetworkPacket** packets, int count) {
+    int received = 0;
+
+    while (received < count) {
+        NetworkPacket* packet = receive_frame(stack);
+
+        if (packet == 0) {
+            break;
+        }
+
+        packets[received++] = packet;
+    }
+
+    return received;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+NetworkPacket* gmac_receive(NetworkStack* stack) {
+    return receive_frame(stack);
+}
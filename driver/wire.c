@@ -0,0 +1,419 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+// In-process virtual wire implementing the GMAC driver interface. The wire works like a hub with a
+// number of ports. Each stack is attached to its own port, and the test harness can act as the other
+// hosts through wire_transmit and wire_receive. Each receiving port has its own bandwidth, latency,
+// loss, duplication and reordering. The wire also implements get_time() with a virtual clock, so that
+// long protocol timeouts can be run in a fraction of the wall clock time.
+
+#include "gmac.h"
+#include "stack.h"
+#include "filter.h"
+#include "wire.h"
+#include "time.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define WIRE_FRAME_SIZE NETWORK_MAX_FRAME_SIZE
+
+//--------------------------------------------------------------------------------------------------
+
+typedef struct {
+    bool in_use;
+    int port;
+    u64 delivery_time;
+
+    // Keeps frames with equal delivery times in the order they were sent.
+    u64 sequence_number;
+
+    int length;
+    u8 data[WIRE_FRAME_SIZE];
+} WireFrame;
+
+typedef struct {
+    // Only attached ports get frames. Nobody would take them off the wire otherwise.
+    bool attached;
+
+    WireImpairment impairment;
+    WireStatistics statistics;
+
+    // The time the last frame queued for this port has been fully serialized onto the wire.
+    u64 link_free_time;
+} WirePort;
+
+typedef struct {
+    int port;
+
+    NetworkPacket* rx_packets[RECEIVE_DESCRIPTOR_COUNT];
+    int rx_index;
+} WireDevice;
+
+//--------------------------------------------------------------------------------------------------
+
+static WireFrame frames[WIRE_FRAME_COUNT];
+static WirePort ports[WIRE_PORT_COUNT];
+
+static WireDevice devices[WIRE_PORT_COUNT];
+static int device_count;
+
+static u64 current_time;
+static u64 next_sequence_number;
+static u32 random_state;
+
+//--------------------------------------------------------------------------------------------------
+
+// Xorshift. The wire keeps its own generator so that a run is reproducible from the seed alone.
+static u32 wire_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool random_event(u32 ppm) {
+    return ppm && (wire_random() % 1000000) < ppm;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void wire_init(u32 random_seed) {
+    memory_fill(frames, 0, sizeof(frames));
+    memory_fill(ports, 0, sizeof(ports));
+
+    device_count = 0;
+    current_time = 0;
+    next_sequence_number = 0;
+    random_state = (random_seed) ? random_seed : 1;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void wire_open_port(int port) {
+    ports[port].attached = true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void wire_set_impairment(int port, const WireImpairment* impairment) {
+    memory_copy(impairment, &ports[port].impairment, sizeof(WireImpairment));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+const WireStatistics* wire_get_statistics(int port) {
+    return &ports[port].statistics;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void queue_frame(int port, const void* data, int size, u64 delivery_time) {
+    WirePort* destination = &ports[port];
+
+    for (int i = 0; i < WIRE_FRAME_COUNT; i++) {
+        WireFrame* frame = &frames[i];
+
+        if (frame->in_use) {
+            continue;
+        }
+
+        frame->in_use = true;
+        frame->port = port;
+        frame->delivery_time = delivery_time;
+        frame->sequence_number = next_sequence_number++;
+        frame->length = size;
+        memory_copy(data, frame->data, size);
+        return;
+    }
+
+    // All frames are in flight. Behave like a full switch buffer.
+    destination->statistics.overflow_count++;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void wire_transmit(int source, const void* data, int size) {
+    if (size > WIRE_FRAME_SIZE) {
+        return;
+    }
+
+    for (int port = 0; port < WIRE_PORT_COUNT; port++) {
+        if (port == source || ports[port].attached == false) {
+            continue;
+        }
+
+        WirePort* destination = &ports[port];
+        WireImpairment* impairment = &destination->impairment;
+
+        destination->statistics.sent_count++;
+
+        // The frame occupies the link even if it is lost at the end.
+        u64 start = (destination->link_free_time > current_time) ? destination->link_free_time : current_time;
+        u64 serialization_time = (impairment->bandwidth) ? (u64)size * 8 * 1000000 / impairment->bandwidth : 0;
+        destination->link_free_time = start + serialization_time;
+
+        if (random_event(impairment->loss_ppm)) {
+            destination->statistics.lost_count++;
+            continue;
+        }
+
+        int copies = 1;
+
+        if (random_event(impairment->duplicate_ppm)) {
+            destination->statistics.duplicated_count++;
+            copies = 2;
+        }
+
+        for (int i = 0; i < copies; i++) {
+            u64 delivery_time = destination->link_free_time + impairment->latency_us;
+
+            if (impairment->jitter_us) {
+                delivery_time += wire_random() % (impairment->jitter_us + 1);
+            }
+
+            if (random_event(impairment->reorder_ppm)) {
+                delivery_time += impairment->reorder_delay_us;
+            }
+
+            queue_frame(port, data, size, delivery_time);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static WireFrame* find_next_frame(int port, bool only_arrived) {
+    WireFrame* next = 0;
+
+    for (int i = 0; i < WIRE_FRAME_COUNT; i++) {
+        WireFrame* frame = &frames[i];
+
+        if (frame->in_use == false || (port >= 0 && frame->port != port)) {
+            continue;
+        }
+
+        if (only_arrived && frame->delivery_time > current_time) {
+            continue;
+        }
+
+        if (next == 0 || frame->delivery_time < next->delivery_time ||
+            (frame->delivery_time == next->delivery_time && frame->sequence_number < next->sequence_number)) {
+            next = frame;
+        }
+    }
+
+    return next;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int wire_receive(int port, void* data, int size) {
+    WireFrame* frame = find_next_frame(port, true);
+
+    if (frame == 0) {
+        return 0;
+    }
+
+    size = limit(size, frame->length);
+    memory_copy(frame->data, data, size);
+
+    frame->in_use = false;
+    ports[port].statistics.delivered_count++;
+
+    return size;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+u64 wire_get_time_us() {
+    return current_time;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void wire_advance_time(u64 microseconds) {
+    current_time += microseconds;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Jumps directly to the arrival of the next frame on any port. Returns false if nothing is in flight.
+bool wire_advance_to_next_frame() {
+    WireFrame* frame = find_next_frame(-1, false);
+
+    if (frame == 0) {
+        return false;
+    }
+
+    if (frame->delivery_time > current_time) {
+        current_time = frame->delivery_time;
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+Time get_time() {
+    return (Time)(current_time / 1000);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_init(NetworkStack* stack) {
+    if (device_count == WIRE_PORT_COUNT) {
+        while (1);
+    }
+
+    WireDevice* device = &devices[device_count];
+    stack->driver = device;
+
+    device->port = device_count++;
+    wire_open_port(device->port);
+
+    for (int i = 0; i < RECEIVE_DESCRIPTOR_COUNT; i++) {
+        device->rx_packets[i] = allocate_reserved_network_packet(stack, NETWORK_RX_PACKET_SIZE);
+    }
+
+    device->rx_index = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_deinit(NetworkStack* stack) {
+    (void)stack;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void gmac_set_mac_address(NetworkStack* stack, const Mac* mac) {
+    (void)stack;
+    (void)mac;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The wire is a hub, and the stack drops the frames of groups it has not joined.
+void gmac_set_multicast_filter(NetworkStack* stack, const Mac* macs, int count) {
+    (void)stack;
+    (void)macs;
+    (void)count;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool gmac_send(NetworkStack* stack, NetworkPacket* packet) {
+    WireDevice* device = stack->driver;
+
+    if (packet->next == 0) {
+        wire_transmit(device->port, (u8 *)&packet->data[packet->index], packet->length);
+    }
+    else {
+        u8 frame[WIRE_FRAME_SIZE];
+        int length = get_network_packet_length(packet);
+
+        if (length <= WIRE_FRAME_SIZE) {
+            copy_from_network_packet(packet, 0, frame, length);
+            wire_transmit(device->port, frame, length);
+        }
+    }
+
+    free_network_packet(stack, packet);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool gmac_can_send(NetworkStack* stack, NetworkPacket** packets, int count) {
+    (void)stack;
+    (void)packets;
+    (void)count;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Frames are put on the wire as soon as they are sent.
+void gmac_flush(NetworkStack* stack) {
+    (void)stack;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static NetworkPacket* receive_frame(NetworkStack* stack) {
+    WireDevice* device = stack->driver;
+
+    while (1) {
+        WireFrame* frame = find_next_frame(device->port, true);
+
+        if (frame == 0) {
+            return 0;
+        }
+
+        ports[device->port].statistics.delivered_count++;
+        frame->in_use = false;
+
+        int flags = filter_get_flags(stack, frame->data, frame->length);
+
+        if (filter_accept(stack, frame->data, frame->length, frame->length, flags) == false) {
+            continue;
+        }
+
+        // The packet pool is exhausted. Drop the frame and keep the buffer in the ring.
+        NetworkPacket* replacement = allocate_reserved_network_packet(stack, NETWORK_RX_PACKET_SIZE);
+
+        if (replacement == 0) {
+            continue;
+        }
+
+        NetworkPacket* packet = device->rx_packets[device->rx_index];
+        packet->index = 0;
+        packet->length = 0;
+
+        // Same as the GMAC. Frames bigger than the packet buffer continue in a chain.
+        if (append_to_network_packet(stack, packet, frame->data, frame->length, true) == false) {
+            free_network_packet(stack, packet->next);
+            free_network_packet(stack, replacement);
+            packet->next = 0;
+            continue;
+        }
+
+        const Mac broadcast = { .address = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } };
+        packet->broadcast = memory_compare(frame->data, &broadcast, sizeof(Mac));
+        packet->multicast = (frame->data[0] & 1) && packet->broadcast == false;
+
+        // Link in a new packet.
+        device->rx_packets[device->rx_index] = replacement;
+
+        if (++device->rx_index == RECEIVE_DESCRIPTOR_COUNT) {
+            device->rx_index = 0;
+        }
+
+        return packet;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int gmac_receive_burst(NetworkStack* stack, NetworkPacket** packets, int count) {
+    int received = 0;
+
+    while (received < count) {
+        NetworkPacket* packet = receive_frame(stack);
+
+        if (packet == 0) {
+            break;
+        }
+
+        packets[received++] = packet;
+    }
+
+    return received;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+NetworkPacket* gmac_receive(NetworkStack* stack) {
+    return receive_frame(stack);
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "utilities.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define WIRE_PORT_COUNT   4
+#define WIRE_FRAME_COUNT  256
+
+//--------------------------------------------------------------------------------------------------
+
+// Probabilities are given in parts per million. All impairments are applied per receiving port.
+typedef struct {
+    u32 bandwidth;        // Bits per second. Zero means infinite bandwidth.
+    u32 latency_us;
+    u32 jitter_us;        // A random delay between zero and this is added to the latency.
+    u32 loss_ppm;
+    u32 duplicate_ppm;
+    u32 reorder_ppm;
+    u32 reorder_delay_us; // Extra delay given to reordered frames.
+} WireImpairment;
+
+typedef struct {
+    u64 sent_count;
+    u64 delivered_count;
+    u64 lost_count;
+    u64 duplicated_count;
+    u64 overflow_count;
+} WireStatistics;
+
+//--------------------------------------------------------------------------------------------------
+
+// Stacks are attached to the ports in the order gmac_init is called, starting at port 0. The remaining
+// ports can be driven by the test harness through wire_transmit and wire_receive, once they are opened.
+// Frames are only delivered to attached ports.
+void wire_init(u32 random_seed);
+void wire_open_port(int port);
+void wire_set_impairment(int port, const WireImpairment* impairment);
+const WireStatistics* wire_get_statistics(int port);
+
+// Sends a frame from the given port to all the other attached ports.
+void wire_transmit(int port, const void* frame, int size);
+
+// Returns the size of the next frame that has arrived at the given port, or zero.
+int wire_receive(int port, void* frame, int size);
+
+// The wire owns the clock returned by get_time(). Time only moves when it is advanced.
+u64 wire_get_time_us();
+void wire_advance_time(u64 microseconds);
+bool wire_advance_to_next_frame();
+
+#endif
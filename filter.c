@@ -0,0 +1,219 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+#include "filter.h"
+#include "stack.h"
+#include "time.h"
+
+//--------------------------------------------------------------------------------------------------
+
+void filter_init(NetworkStack* stack) {
+    memory_fill(&stack->filter, 0, sizeof(Filter));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool ends_program(const FilterInstruction* instruction) {
+    return instruction->opcode == FILTER_ACCEPT || instruction->opcode == FILTER_DROP;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool is_jump(const FilterInstruction* instruction) {
+    return instruction->opcode >= FILTER_JUMP_EQUAL && instruction->opcode <= FILTER_JUMP_SET;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool filter_set_program(NetworkStack* stack, const FilterInstruction* program, int size) {
+    Filter* filter = &stack->filter;
+
+    if (size < 0 || size > FILTER_PROGRAM_SIZE || (size && ends_program(&program[size - 1]) == false)) {
+        return false;
+    }
+
+    for (int i = 0; i < size; i++) {
+        const FilterInstruction* instruction = &program[i];
+
+        if (instruction->opcode > FILTER_DROP) {
+            return false;
+        }
+
+        if (ends_program(instruction) && instruction->rule >= FILTER_RULE_COUNT) {
+            return false;
+        }
+
+        // The next instruction is always there, since the last one ends the program.
+        if (is_jump(instruction) && (i + 1 + instruction->jump_true >= size || i + 1 + instruction->jump_false >= size)) {
+            return false;
+        }
+    }
+
+    memory_copy(program, filter->program, size * sizeof(FilterInstruction));
+    filter->program_size = size;
+    filter->short_count = 0;
+
+    for (int i = 0; i < FILTER_RULE_COUNT; i++) {
+        FilterRule* rule = &filter->rules[i];
+
+        rule->accepted_count = 0;
+        rule->dropped_count = 0;
+        rule->limited_count = 0;
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// A rate of zero removes the limit. The bucket starts out full.
+void filter_set_rate_limit(NetworkStack* stack, int rule_index, u32 rate, u32 burst) {
+    if (rule_index < 0 || rule_index >= FILTER_RULE_COUNT) {
+        return;
+    }
+
+    FilterRule* rule = &stack->filter.rules[rule_index];
+
+    rule->rate = rate;
+    rule->burst = burst;
+    rule->tokens = (u64)burst * 1000;
+    rule->time = get_time();
+}
+
+//--------------------------------------------------------------------------------------------------
+
+const FilterRule* filter_get_rule(NetworkStack* stack, int rule_index) {
+    if (rule_index < 0 || rule_index >= FILTER_RULE_COUNT) {
+        return 0;
+    }
+
+    return &stack->filter.rules[rule_index];
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The tokens are kept in thousandths, so a rate of less than one token per millisecond still fills the
+// bucket.
+static bool take_token(FilterRule* rule) {
+    Time now = get_time();
+    u64 capacity = (u64)rule->burst * 1000;
+
+    rule->tokens += (u64)get_elapsed(rule->time, now) * rule->rate;
+    rule->time = now;
+
+    if (rule->tokens > capacity) {
+        rule->tokens = capacity;
+    }
+
+    if (rule->tokens < 1000) {
+        return false;
+    }
+
+    rule->tokens -= 1000;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool end_program(Filter* filter, const FilterInstruction* instruction) {
+    FilterRule* rule = &filter->rules[instruction->rule];
+
+    if (instruction->opcode == FILTER_DROP) {
+        rule->dropped_count++;
+        return false;
+    }
+
+    if (rule->rate && take_token(rule) == false) {
+        rule->limited_count++;
+        return false;
+    }
+
+    rule->accepted_count++;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool filter_accept(NetworkStack* stack, const u8* data, int length, int frame_length, int flags) {
+    Filter* filter = &stack->filter;
+    u32 accumulator = 0;
+
+    if (filter->program_size == 0) {
+        return true;
+    }
+
+    for (const FilterInstruction* instruction = filter->program;; instruction++) {
+        u32 value = instruction->value;
+
+        switch (instruction->opcode) {
+            case FILTER_LOAD_BYTE :
+            case FILTER_LOAD_HALF :
+            case FILTER_LOAD_WORD : {
+                int size = 1 << (instruction->opcode - FILTER_LOAD_BYTE);
+
+                if (length < size || value > (u32)(length - size)) {
+                    filter->short_count++;
+                    return false;
+                }
+
+                accumulator = 0;
+
+                for (int i = 0; i < size; i++) {
+                    accumulator = accumulator << 8 | data[value + i];
+                }
+
+                break;
+            }
+            case FILTER_LOAD_LENGTH : {
+                accumulator = frame_length;
+                break;
+            }
+            case FILTER_LOAD_FLAGS : {
+                accumulator = flags;
+                break;
+            }
+            case FILTER_AND : {
+                accumulator &= value;
+                break;
+            }
+            case FILTER_JUMP_EQUAL : {
+                instruction += (accumulator == value) ? instruction->jump_true : instruction->jump_false;
+                break;
+            }
+            case FILTER_JUMP_GREATER : {
+                instruction += (accumulator > value) ? instruction->jump_true : instruction->jump_false;
+                break;
+            }
+            case FILTER_JUMP_SET : {
+                instruction += (accumulator & value) ? instruction->jump_true : instruction->jump_false;
+                break;
+            }
+            default : {
+                return end_program(filter, instruction);
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int filter_get_flags(NetworkStack* stack, const u8* data, int length) {
+    const Mac broadcast = { .address = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } };
+
+    if (length < (int)sizeof(Mac)) {
+        return 0;
+    }
+
+    if (memory_compare(data, &broadcast, sizeof(Mac))) {
+        return FILTER_FLAG_BROADCAST;
+    }
+
+    if (data[0] & 1) {
+        return FILTER_FLAG_MULTICAST;
+    }
+
+    if (memory_compare(data, get_our_mac(stack), sizeof(Mac))) {
+        return FILTER_FLAG_OUR_MAC;
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "utilities.h"
+#include "network.h"
+#include "time.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#ifndef FILTER_PROGRAM_SIZE
+#define FILTER_PROGRAM_SIZE 32
+#endif
+
+#ifndef FILTER_RULE_COUNT
+#define FILTER_RULE_COUNT 8
+#endif
+
+//--------------------------------------------------------------------------------------------------
+
+// What the driver knows about the destination of a frame. The GMAC takes these from the RX
+// descriptor, the other drivers from the destination MAC.
+enum {
+    FILTER_FLAG_BROADCAST = 1 << 0,
+    FILTER_FLAG_MULTICAST = 1 << 1,
+    FILTER_FLAG_OUR_MAC   = 1 << 2,
+};
+
+// A small subset of classic BPF. The loads read big endian values at an offset from the start of the
+// frame into the accumulator. A jump skips jump_true or jump_false instructions forward, so every
+// program ends. The accept and drop instructions end the program and count the frame for their rule.
+typedef enum {
+    FILTER_LOAD_BYTE,
+    FILTER_LOAD_HALF,
+    FILTER_LOAD_WORD,
+    FILTER_LOAD_LENGTH,
+    FILTER_LOAD_FLAGS,
+    FILTER_AND,
+    FILTER_JUMP_EQUAL,
+    FILTER_JUMP_GREATER,
+    FILTER_JUMP_SET,
+    FILTER_ACCEPT,
+    FILTER_DROP,
+} FilterOpcode;
+
+typedef struct {
+    u8  opcode;
+    u8  jump_true;
+    u8  jump_false;
+    u8  rule;
+    u32 value;
+} FilterInstruction;
+
+// Frames accepted by a rule with a rate limit take a token from its bucket, and are dropped when the
+// bucket is empty. The bucket holds up to burst tokens, and gets rate tokens per second.
+typedef struct {
+    u32 rate;
+    u32 burst;
+    u64 tokens;
+    Time time;
+
+    u32 accepted_count;
+    u32 dropped_count;
+    u32 limited_count;
+} FilterRule;
+
+// Without a program every frame is accepted.
+typedef struct {
+    FilterInstruction program[FILTER_PROGRAM_SIZE];
+    int program_size;
+
+    FilterRule rules[FILTER_RULE_COUNT];
+
+    // Frames dropped because the program read past the bytes the driver had.
+    u32 short_count;
+} Filter;
+
+//--------------------------------------------------------------------------------------------------
+
+void filter_init(NetworkStack* stack);
+
+// Returns false, and keeps the old program, if a jump leaves the program, a rule does not exist or the
+// last instruction does not end the program. The counters of all rules are reset.
+bool filter_set_program(NetworkStack* stack, const FilterInstruction* program, int size);
+void filter_set_rate_limit(NetworkStack* stack, int rule, u32 rate, u32 burst);
+const FilterRule* filter_get_rule(NetworkStack* stack, int rule);
+
+// Called by the driver before a received frame is given a packet. The data holds the first length
+// bytes of a frame of frame_length bytes. Frames which are not accepted go straight back to the RX
+// ring.
+bool filter_accept(NetworkStack* stack, const u8* data, int length, int frame_length, int flags);
+
+// The flags for drivers which only have the frame to go by.
+int filter_get_flags(NetworkStack* stack, const u8* data, int length);
+
+#endif
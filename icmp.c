@@ -2,6 +2,7 @@
 
 #include "icmp.h"
 #include "ip.h"
+#include "checksum.h"
 
 //--------------------------------------------------------------------------------------------------
 
@@ -22,32 +23,16 @@ typedef struct PACKED {
 
 //--------------------------------------------------------------------------------------------------
 
-static u16 compute_icmp_checksum(const void* data, int size) {
-    const u8* pointer = data;
-    u32 sum = 0;
-
-    while (size > 1) {
-        sum += read_be16(pointer);
-        pointer += 2;
-        size -= 2;
-    }
-
-    if (size) {
-        sum += *(u8 *)pointer << 8;
-    }
-
-    while (sum >> 16) {
-        sum = (sum & 0xffff) + (sum >> 16);
-    }
-
-    return (u16)~sum;
+static u16 compute_icmp_checksum(NetworkPacket* packet) {
+    return checksum_finish(checksum_add_packet(0, packet));
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void handle_icmp(NetworkPacket* packet) {
-    if (packet->length < sizeof(IcmpHeader)) {
-        free_network_packet(packet);
+void handle_icmp(NetworkStack* stack, NetworkPacket* packet) {
+    // No hardware checks the ICMP checksum, so it is always verified here.
+    if (packet->length < sizeof(IcmpHeader) || compute_icmp_checksum(packet) != 0) {
+        free_network_packet(stack, packet);
         return;
     }
 
@@ -58,10 +43,13 @@ void handle_icmp(NetworkPacket* packet) {
         header->type = ICMP_TYPE_PING_REPLY;
         header->code = 0;
         write_be16(0, &header->checksum);
-        write_be16(compute_icmp_checksum(header, packet->length), &header->checksum);
-        ip_send(packet, packet->senders_ip, IP_PROTOCOL_ICMP);
+        write_be16(compute_icmp_checksum(packet), &header->checksum);
+
+        if (ip_send(stack, packet, packet->senders_ip, IP_PROTOCOL_ICMP) == false) {
+            free_network_packet(stack, packet);
+        }
     }
     else {
-        free_network_packet(packet);
+        free_network_packet(stack, packet);
     }
 }
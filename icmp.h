@@ -8,6 +8,6 @@
 
 //--------------------------------------------------------------------------------------------------
 
-void handle_icmp(NetworkPacket* packet);
+void handle_icmp(NetworkStack* stack, NetworkPacket* packet);
 
 #endif
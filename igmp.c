@@ -0,0 +1,277 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+// Host side of IGMPv2 (RFC 2236). IGMPv3 queries are answered with version 2 reports, which makes the
+// router fall back to version 2 for our groups (RFC 3376).
+// @Incomplete: messages are sent without the router alert option, and there is no fallback to
+// version 1 reports when a version 1 router is present.
+
+#include "igmp.h"
+#include "ip.h"
+#include "stack.h"
+#include "gmac.h"
+#include "checksum.h"
+#include "random.h"
+#include "time.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define IGMP_ALL_HOSTS    0xE0000001
+#define IGMP_ALL_ROUTERS  0xE0000002
+
+// The report sent when joining is repeated once within this many milliseconds, in case it is lost.
+#define IGMP_UNSOLICITED_REPORT_INTERVAL  10000
+
+// Used for version 1 queries, which have no max response time.
+#define IGMP_DEFAULT_MAX_RESPONSE_TIME  10000
+
+//--------------------------------------------------------------------------------------------------
+
+enum {
+    IGMP_TYPE_QUERY       = 0x11,
+    IGMP_TYPE_V1_REPORT   = 0x12,
+    IGMP_TYPE_V2_REPORT   = 0x16,
+    IGMP_TYPE_LEAVE       = 0x17,
+};
+
+typedef struct PACKED {
+    u8  type;
+    u8  max_response_time;
+    u16 checksum;
+    u32 group;
+} IgmpHeader;
+
+//--------------------------------------------------------------------------------------------------
+
+void igmp_init(NetworkStack* stack) {
+    memory_fill(stack->igmp.groups, 0, sizeof(stack->igmp.groups));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static IgmpGroup* find_group(NetworkStack* stack, Ip ip) {
+    for (int i = 0; i < IGMP_GROUP_COUNT; i++) {
+        if (stack->igmp.groups[i].ip == ip) {
+            return &stack->igmp.groups[i];
+        }
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// We are always a member of the all hosts group, so that queries are received.
+bool igmp_is_member(NetworkStack* stack, Ip ip) {
+    return ip == IGMP_ALL_HOSTS || (ip && find_group(stack, ip));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Lets the MACs of the joined groups through the driver filter. The all hosts group is only added
+// while there is a group to report, since the queries are of no interest otherwise.
+static void update_multicast_filter(NetworkStack* stack) {
+    Mac macs[IGMP_GROUP_COUNT + 1];
+    int count = 0;
+
+    for (int i = 0; i < IGMP_GROUP_COUNT; i++) {
+        if (stack->igmp.groups[i].ip) {
+            ip_to_multicast_mac(stack->igmp.groups[i].ip, &macs[count++]);
+        }
+    }
+
+    if (count) {
+        ip_to_multicast_mac(IGMP_ALL_HOSTS, &macs[count++]);
+    }
+
+    gmac_set_multicast_filter(stack, macs, count);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool send_igmp_packet(NetworkStack* stack, int type, Ip group, Ip ip) {
+    NetworkPacket* packet = allocate_reserved_network_packet(stack, sizeof(IgmpHeader));
+
+    if (packet == 0) {
+        return false;
+    }
+
+    IgmpHeader* header = (IgmpHeader *)&packet->data[packet->index];
+    packet->length = sizeof(IgmpHeader);
+
+    header->type = type;
+    header->max_response_time = 0;
+    write_be16(0, &header->checksum);
+    write_be32(group, &header->group);
+    write_be16(checksum_finish(checksum_add(0, header, sizeof(IgmpHeader))), &header->checksum);
+
+    if (ip_send(stack, packet, ip, IP_PROTOCOL_IGMP) == false) {
+        free_network_packet(stack, packet);
+        return false;
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Reports are sent after a random delay, so that the members of a group do not all answer a query at
+// the same time. An earlier pending report is kept.
+static void start_report_timer(IgmpGroup* group, u32 max_delay) {
+    Time now = get_time();
+    u32 delay = random() % (max_delay + 1);
+
+    if (group->report_pending) {
+        u32 elapsed = get_elapsed(group->report_time, now);
+
+        if (elapsed < group->report_delay && group->report_delay - elapsed <= delay) {
+            return;
+        }
+    }
+
+    group->report_pending = true;
+    group->report_time = now;
+    group->report_delay = delay;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void igmp_task(NetworkStack* stack) {
+    Time now = get_time();
+
+    for (int i = 0; i < IGMP_GROUP_COUNT; i++) {
+        IgmpGroup* group = &stack->igmp.groups[i];
+
+        if (group->report_pending == false || get_elapsed(group->report_time, now) < group->report_delay) {
+            continue;
+        }
+
+        // If the TX ring is full, the report is retried on the next call.
+        if (send_igmp_packet(stack, IGMP_TYPE_V2_REPORT, group->ip, group->ip)) {
+            group->report_pending = false;
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool ip_join_group(NetworkStack* stack, Ip ip) {
+    if (ip_is_multicast(ip) == false) {
+        return false;
+    }
+
+    if (ip == IGMP_ALL_HOSTS) {
+        return true;
+    }
+
+    IgmpGroup* group = find_group(stack, ip);
+
+    if (group) {
+        group->member_count++;
+        return true;
+    }
+
+    group = find_group(stack, 0);
+
+    if (group == 0) {
+        return false;
+    }
+
+    group->ip = ip;
+    group->member_count = 1;
+    group->report_pending = false;
+
+    update_multicast_filter(stack);
+
+    // Routers and snooping switches start forwarding the group when they see the report. It is sent
+    // again later in case the first one is lost, or right away from igmp_task if it could not be sent.
+    if (send_igmp_packet(stack, IGMP_TYPE_V2_REPORT, ip, ip)) {
+        start_report_timer(group, IGMP_UNSOLICITED_REPORT_INTERVAL);
+    }
+    else {
+        start_report_timer(group, 0);
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The leave message makes the router ask whether other members remain, so it can stop forwarding the
+// group sooner. It is not retried, since the router also stops once its queries go unanswered.
+void ip_leave_group(NetworkStack* stack, Ip ip) {
+    IgmpGroup* group = (ip) ? find_group(stack, ip) : 0;
+
+    if (group == 0 || --group->member_count) {
+        return;
+    }
+
+    group->ip = 0;
+    group->report_pending = false;
+
+    update_multicast_filter(stack);
+    send_igmp_packet(stack, IGMP_TYPE_LEAVE, ip, IGMP_ALL_ROUTERS);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// In version 2 queries the max response time is in units of 100 ms, and version 1 queries leave it
+// zero. Version 3 queries are longer, and codes from 128 and up hold a floating point value.
+static u32 get_max_response_time(IgmpHeader* header, int length) {
+    int code = header->max_response_time;
+
+    if (code == 0) {
+        return IGMP_DEFAULT_MAX_RESPONSE_TIME;
+    }
+
+    if (length > (int)sizeof(IgmpHeader) && code >= 128) {
+        int exponent = (code >> 4) & 7;
+        int mantissa = code & 0xF;
+
+        return 100 * ((mantissa | 0x10) << (exponent + 3));
+    }
+
+    return 100 * code;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void handle_query(NetworkStack* stack, IgmpHeader* header, int length) {
+    Ip ip = read_be32(&header->group);
+    u32 max_delay = get_max_response_time(header, length);
+
+    // A general query asks about every group, and a group specific query only about its group.
+    for (int i = 0; i < IGMP_GROUP_COUNT; i++) {
+        IgmpGroup* group = &stack->igmp.groups[i];
+
+        if (group->ip && (ip == 0 || ip == group->ip)) {
+            start_report_timer(group, max_delay);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void handle_igmp(NetworkStack* stack, NetworkPacket* packet) {
+    int length = get_network_packet_length(packet);
+
+    if (packet->length < (int)sizeof(IgmpHeader) || checksum_finish(checksum_add_packet(0, packet)) != 0) {
+        free_network_packet(stack, packet);
+        return;
+    }
+
+    IgmpHeader* header = (IgmpHeader *)&packet->data[packet->index];
+
+    if (header->type == IGMP_TYPE_QUERY) {
+        handle_query(stack, header, length);
+    }
+    else if (header->type == IGMP_TYPE_V1_REPORT || header->type == IGMP_TYPE_V2_REPORT) {
+        // Another member has answered for the group. The router only needs one report.
+        IgmpGroup* group = find_group(stack, read_be32(&header->group));
+
+        if (group && group->ip) {
+            group->report_pending = false;
+        }
+    }
+
+    free_network_packet(stack, packet);
+}
@@ -0,0 +1,46 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+#ifndef IGMP_H
+#define IGMP_H
+
+#include "utilities.h"
+#include "network.h"
+#include "time.h"
+
+//--------------------------------------------------------------------------------------------------
+
+// Groups which can be joined at the same time, not counting the all hosts group.
+#ifndef IGMP_GROUP_COUNT
+#define IGMP_GROUP_COUNT 8
+#endif
+
+//--------------------------------------------------------------------------------------------------
+
+// A group is in use if the IP is not zero. While a report is pending, it is sent once the delay has
+// passed since report_time, unless another member of the group reports first.
+typedef struct {
+    Ip ip;
+    int member_count;
+
+    bool report_pending;
+    Time report_time;
+    u32 report_delay;
+} IgmpGroup;
+
+typedef struct {
+    IgmpGroup groups[IGMP_GROUP_COUNT];
+} Igmp;
+
+//--------------------------------------------------------------------------------------------------
+
+void igmp_init(NetworkStack* stack);
+void igmp_task(NetworkStack* stack);
+bool igmp_is_member(NetworkStack* stack, Ip ip);
+void handle_igmp(NetworkStack* stack, NetworkPacket* packet);
+
+// Datagrams sent to a group are only received after joining it. Joins are counted, and the group is
+// left when ip_leave_group has been called as many times. Returns false if the group table is full.
+bool ip_join_group(NetworkStack* stack, Ip ip);
+void ip_leave_group(NetworkStack* stack, Ip ip);
+
+#endif
@@ -1,33 +1,24 @@
 // Copyright (c) 2021 Bjørn Brodtkorb
 
 #include "ip.h"
+#include "stack.h"
 #include "udp.h"
 #include "mac.h"
+#include "gmac.h"
 #include "icmp.h"
+#include "igmp.h"
+#include "arp.h"
+#include "checksum.h"
+#include "route.h"
+#include "random.h"
+#include "time.h"
 
 //--------------------------------------------------------------------------------------------------
 
-enum {
-    IP_FLAG_DONT_FRAGMENT  = 1 << 14,
-    IP_FLAG_MORE_FRAGMENTS = 1 << 15,
-};
+// A datagram is dropped if its fragments have not all arrived this many milliseconds after the first.
+#define IP_REASSEMBLY_TIMEOUT  2000
 
-//--------------------------------------------------------------------------------------------------
-
-typedef struct PACKED {
-    u8   header_length                      : 4;
-    u8   version                            : 4;
-    u8   explicit_congestion_notification   : 2;
-    u8   differentiated_services_code_point : 6;
-    u16  length;
-    u16  id;
-    u16  fragment_offset;
-    u8   time_to_live;
-    u8   protocol;
-    u16  checksum;
-    u32  senders_ip;
-    u32  target_ip;
-} IpHeader;
+#define IP_TIME_TO_LIVE  0xFF
 
 //--------------------------------------------------------------------------------------------------
 
@@ -85,59 +76,349 @@ void ip_to_string(Ip ip, char* string) {
 
 //--------------------------------------------------------------------------------------------------
 
-static u16 compute_ip_checksum(IpHeader* header) {
-    u32 sum = 0;
-    int size = sizeof(IpHeader);
-    u8* pointer = (u8 *)header;
+static u16 compute_ip_checksum(IpHeader* header, int header_length) {
+    return checksum_finish(checksum_add(0, header, header_length));
+}
 
-    for (; size > 1; size -= 2) {
-        sum += read_be16(pointer);
-        pointer += 2;
-    }
+//--------------------------------------------------------------------------------------------------
+
+static bool should_broadcast(NetworkStack* stack, Ip ip) {
+    Ip inverted_netmask = ~get_our_netmask(stack);
+    return ((inverted_netmask & ip) == inverted_netmask);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Class D, 224.0.0.0/4.
+bool ip_is_multicast(Ip ip) {
+    return (ip >> 28) == 0xE;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The low 23 bits of the group are put in the 01:00:5E block (RFC 1112). 32 groups share each MAC.
+void ip_to_multicast_mac(Ip ip, Mac* mac) {
+    mac->address[0] = 0x01;
+    mac->address[1] = 0x00;
+    mac->address[2] = 0x5E;
+    mac->address[3] = (ip >> 16) & 0x7F;
+    mac->address[4] = (ip >> 8) & 0xFF;
+    mac->address[5] = ip & 0xFF;
+}
+
+//--------------------------------------------------------------------------------------------------
 
-    while (sum >> 16) {
-        sum = (sum & 0xffff) + (sum >> 16);
+// Multicast datagrams stay on the local network unless the TTL is raised.
+static u8 get_time_to_live(Ip ip) {
+    return (ip_is_multicast(ip)) ? IP_MULTICAST_TIME_TO_LIVE : IP_TIME_TO_LIVE;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The header template holds the fields which are the same in every header we send, with the others
+// left zero. It is rebuilt when our IP changes. The TTL depends on the destination, so it is left out
+// as well.
+static IpHeader* get_header_template(NetworkStack* stack) {
+    Ipv4* ipv4 = &stack->ipv4;
+    Ip our_ip = get_our_ip(stack);
+
+    if (ipv4->template_valid && ipv4->template_ip == our_ip) {
+        return &ipv4->header_template;
     }
 
-    return (u16)~sum;
+    IpHeader* header = &ipv4->header_template;
+    memory_fill(header, 0, sizeof(IpHeader));
+
+    header->version = 4;
+    header->header_length = sizeof(IpHeader) / sizeof(u32);
+    write_be32(our_ip, &header->senders_ip);
+
+    ipv4->template_sum = checksum_add(0, header, sizeof(IpHeader));
+    ipv4->template_ip = our_ip;
+    ipv4->template_valid = true;
+
+    return header;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static bool should_broadcast(Ip ip) {
-    Ip inverted_netmask = ~get_our_netmask();
-    return ((inverted_netmask & ip) == inverted_netmask);
+// Writes everything but the length, the ID and the checksum.
+static void write_ip_header(NetworkStack* stack, IpHeader* header, Ip ip, int protocol) {
+    *header = *get_header_template(stack);
+
+    header->time_to_live = get_time_to_live(ip);
+    header->protocol = protocol;
+    write_be16(IP_FLAG_DONT_FRAGMENT, &header->fragment_offset);
+    write_be32(ip, &header->target_ip);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void ip_send(NetworkPacket* packet, Ip ip, int protocol) {
+// The header is copied from the template and only the fields which differ between packets are
+// written. The checksum of the template is patched with the same fields (RFC 1624) instead of summing
+// the whole header again. That is cheap enough to always do, also when the hardware would fill it in.
+static void push_ip_header(NetworkStack* stack, NetworkPacket* packet, Ip ip, int protocol, u16 id, u16 fragment_offset) {
     packet->index -= sizeof(IpHeader);
     packet->length += sizeof(IpHeader);
 
     IpHeader* header = (IpHeader *)&packet->data[packet->index];
+    u16 length = get_network_packet_length(packet);
+    u8 time_to_live = get_time_to_live(ip);
 
-    header->version = 4;
-    header->header_length = sizeof(IpHeader) / sizeof(u32);
-    header->differentiated_services_code_point = 0;
-    header->explicit_congestion_notification = 0;
-    header->time_to_live = 0xFF;
-    header->protocol = protocol;
+    *header = *get_header_template(stack);
 
-    write_be16(packet->length, &header->length);
-    write_be16(0, &header->id);
-    write_be16(IP_FLAG_DONT_FRAGMENT, &header->fragment_offset);
-    write_be16(0, &header->checksum);
-    write_be32(get_our_ip(), &header->senders_ip);
+    header->time_to_live = time_to_live;
+    header->protocol = protocol;
+    write_be16(length, &header->length);
+    write_be16(id, &header->id);
+    write_be16(fragment_offset, &header->fragment_offset);
     write_be32(ip, &header->target_ip);
-    write_be16(compute_ip_checksum(header), &header->checksum);
-    
-    if (should_broadcast(ip)) {
-        mac_broadcast(packet, ETHER_TYPE_IPV4);
+
+    u32 sum = stack->ipv4.template_sum + length + id + fragment_offset + (time_to_live << 8 | protocol) + (ip >> 16) + (ip & 0xFFFF);
+    write_be16(checksum_finish(sum), &header->checksum);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void pop_ip_header(NetworkPacket* packet) {
+    packet->index += sizeof(IpHeader);
+    packet->length -= sizeof(IpHeader);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Finds where the frames to the IP go. Broadcast frames need no MAC, and the MAC of a group follows
+// from its IP. Otherwise the MAC of the next hop is looked up, and resolved is false if ARP has not
+// found it yet. Returns false if there is no route.
+static bool find_destination(NetworkStack* stack, Ip ip, bool* broadcast, Ip* next_hop, Mac* mac, bool* resolved) {
+    *next_hop = 0;
+
+    if (ip_is_multicast(ip)) {
+        ip_to_multicast_mac(ip, mac);
+        *broadcast = false;
+        *resolved = true;
+        return true;
+    }
+
+    *broadcast = should_broadcast(stack, ip);
+    *resolved = false;
+
+    if (*broadcast) {
+        return true;
+    }
+
+    *next_hop = route_lookup(stack, ip);
+
+    if (*next_hop == 0) {
+        return false;
+    }
+
+    *resolved = arp_lookup(stack, *next_hop, mac);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Frames for the destination are broadcast, sent to a resolved MAC, or handed to the ARP layer for
+// the next hop when mac is zero.
+static bool send_frame(NetworkStack* stack, NetworkPacket* packet, bool broadcast, const Mac* mac, Ip next_hop) {
+    if (broadcast) {
+        return mac_broadcast(stack, packet, ETHER_TYPE_IPV4);
+    }
+
+    if (mac) {
+        return mac_send(stack, packet, mac, ETHER_TYPE_IPV4);
+    }
+
+    return mac_send_to_ip(stack, packet, next_hop);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Links the fragments back into one chain, which holds the same data as before the datagram was cut.
+static void join_fragments(NetworkPacket** fragments, int count) {
+    for (int i = 1; i < count; i++) {
+        link_network_packet(fragments[i - 1], fragments[i]);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Sends a datagram which does not fit in one frame as fragments. The chain is cut into all the
+// fragments before any is sent, so the caller still owns the datagram if the pool runs out, if the
+// next hop is not resolved yet, or if the TX ring does not have room for all the fragments.
+static bool send_fragments(NetworkStack* stack, NetworkPacket* packet, int length, Ip ip, int protocol) {
+    if (length > IP_MAX_DATAGRAM_SIZE - (int)sizeof(IpHeader)) {
+        return false;
+    }
+
+    bool broadcast;
+    bool resolved;
+    Ip next_hop;
+    Mac mac;
+
+    if (find_destination(stack, ip, &broadcast, &next_hop, &mac, &resolved) == false) {
+        return false;
+    }
+
+    // The ARP queue of an entry is shorter than most datagrams. Start the resolution instead, and let
+    // the caller retry once the reply is in.
+    if (broadcast == false && resolved == false) {
+        arp_resolve(stack, next_hop);
+        return false;
+    }
+
+    NetworkPacket* fragments[IP_MAX_FRAGMENT_COUNT];
+    int count = 0;
+
+    fragments[count++] = packet;
+
+    for (int offset = IP_FRAGMENT_SIZE; offset < length; offset += IP_FRAGMENT_SIZE) {
+        NetworkPacket* rest = split_network_packet(stack, fragments[count - 1], IP_FRAGMENT_SIZE);
+
+        if (rest == 0) {
+            join_fragments(fragments, count);
+            return false;
+        }
+
+        fragments[count++] = rest;
+    }
+
+    // Half a datagram is of no use to the receiver.
+    if (gmac_can_send(stack, fragments, count) == false) {
+        join_fragments(fragments, count);
+        return false;
+    }
+
+    u16 id = ip_next_id(stack);
+
+    for (int i = 0; i < count; i++) {
+        NetworkPacket* fragment = fragments[i];
+        u16 flags = (i == count - 1) ? 0 : IP_FLAG_MORE_FRAGMENTS;
+
+        push_ip_header(stack, fragment, ip, protocol, id, flags | (i * IP_FRAGMENT_SIZE / 8));
+
+        // The driver said it has room for all of them. A driver without a ring may still refuse one,
+        // and once the first fragment is out the rest are lost, the same as on a congested link.
+        if (send_frame(stack, fragment, broadcast, &mac, next_hop) == false) {
+            pop_ip_header(fragment);
+
+            if (i == 0) {
+                join_fragments(fragments, count);
+                return false;
+            }
+
+            for (int j = i; j < count; j++) {
+                free_network_packet(stack, fragments[j]);
+            }
+
+            break;
+        }
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns false if the packet could not be queued for transmission, or if there is no route to the
+// IP. The IP header is removed again so the caller can retry or free the packet.
+bool ip_send(NetworkStack* stack, NetworkPacket* packet, Ip ip, int protocol) {
+    int length = get_network_packet_length(packet);
+
+    if (length > IP_MAX_PAYLOAD_SIZE) {
+        return send_fragments(stack, packet, length, ip, protocol);
+    }
+
+    push_ip_header(stack, packet, ip, protocol, ip_next_id(stack), IP_FLAG_DONT_FRAGMENT);
+    bool sent;
+
+    if (ip_is_multicast(ip)) {
+        Mac mac;
+        ip_to_multicast_mac(ip, &mac);
+        sent = mac_send(stack, packet, &mac, ETHER_TYPE_IPV4);
+    }
+    else if (should_broadcast(stack, ip)) {
+        sent = mac_broadcast(stack, packet, ETHER_TYPE_IPV4);
     }
     else {
-        mac_send_to_ip(packet, ip);
+        Ip next_hop = route_lookup(stack, ip);
+        sent = next_hop && mac_send_to_ip(stack, packet, next_hop);
+    }
+
+    if (sent == false) {
+        pop_ip_header(packet);
+    }
+
+    return sent;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int ip_send_burst(NetworkStack* stack, NetworkPacket** packets, int count, Ip ip, int protocol) {
+    bool broadcast;
+    bool resolved;
+    Ip next_hop;
+    Mac mac;
+
+    if (find_destination(stack, ip, &broadcast, &next_hop, &mac, &resolved) == false) {
+        return 0;
+    }
+
+    // The ARP queue of an entry only holds a couple of packets. Start the resolution instead, and let
+    // the caller keep the whole burst until the reply is in.
+    if (broadcast == false && resolved == false) {
+        arp_resolve(stack, next_hop);
+        return 0;
+    }
+
+    int sent = 0;
+
+    for (; sent < count; sent++) {
+        NetworkPacket* packet = packets[sent];
+        int length = get_network_packet_length(packet);
+
+        if (length > IP_MAX_PAYLOAD_SIZE) {
+            if (send_fragments(stack, packet, length, ip, protocol) == false) {
+                break;
+            }
+
+            continue;
+        }
+
+        push_ip_header(stack, packet, ip, protocol, ip_next_id(stack), IP_FLAG_DONT_FRAGMENT);
+
+        if (send_frame(stack, packet, broadcast, &mac, next_hop) == false) {
+            pop_ip_header(packet);
+            break;
+        }
+    }
+
+    return sent;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Writes the MAC and IP headers of a frame to the IP. The length, ID and checksum are left zero for
+// the caller to fill in. Returns false if there is no route, or if the MAC of the next hop is not
+// resolved yet.
+bool ip_write_header_template(NetworkStack* stack, u8* template, Ip ip, int protocol) {
+    Mac mac = { .address = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } };
+    bool broadcast;
+    bool resolved;
+    Ip next_hop;
+
+    if (find_destination(stack, ip, &broadcast, &next_hop, &mac, &resolved) == false) {
+        return false;
     }
+
+    if (broadcast == false && resolved == false) {
+        return false;
+    }
+
+    mac_write_header(stack, (MacHeader *)template, &mac, ETHER_TYPE_IPV4);
+    write_ip_header(stack, (IpHeader *)(template + sizeof(MacHeader)), ip, protocol);
+    return true;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -147,7 +428,7 @@ static bool verify_ip_header(IpHeader* header, int packet_size) {
         return false;
     }
 
-    if (read_be16(&header->fragment_offset) & IP_FLAG_MORE_FRAGMENTS) {
+    if (header->header_length < sizeof(IpHeader) / sizeof(u32)) {
         return false;
     }
 
@@ -160,8 +441,13 @@ static bool verify_ip_header(IpHeader* header, int packet_size) {
 
 //--------------------------------------------------------------------------------------------------
 
-static bool should_filter_away(NetworkPacket* packet) {
-    Ip our_ip = get_our_ip();
+static bool should_filter_away(NetworkStack* stack, NetworkPacket* packet) {
+    Ip our_ip = get_our_ip(stack);
+
+    // The hardware filter is a hash, so frames of groups we have not joined can still get through.
+    if (ip_is_multicast(packet->target_ip)) {
+        return packet->multicast == false || igmp_is_member(stack, packet->target_ip) == false;
+    }
 
     // @Hack: what should we do with the broadcast frames.
     if (our_ip == 0 || our_ip == packet->target_ip || packet->target_ip == 0xFFFFFFFF) {
@@ -173,10 +459,251 @@ static bool should_filter_away(NetworkPacket* packet) {
 
 //--------------------------------------------------------------------------------------------------
 
-void handle_ip(NetworkPacket* packet) {
+void ip_init(NetworkStack* stack) {
+    Ipv4* ipv4 = &stack->ipv4;
+
+    for (int i = 0; i < IP_REASSEMBLY_COUNT; i++) {
+        ipv4->reassemblies[i].used = false;
+    }
+
+    ipv4->buffer_count = 0;
+    ipv4->template_valid = false;
+
+    // Start somewhere else after every reboot, so the receiver does not mix up our datagrams with the
+    // ones sent before.
+    ipv4->next_id = random();
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Every datagram gets its own ID, so fragments from different datagrams are never put together.
+u16 ip_next_id(NetworkStack* stack) {
+    return stack->ipv4.next_id++;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void free_reassembly(NetworkStack* stack, IpReassembly* reassembly) {
+    for (int i = 0; i < reassembly->fragment_count; i++) {
+        free_network_packet(stack, reassembly->fragments[i]);
+    }
+
+    stack->ipv4.buffer_count -= reassembly->buffer_count;
+    reassembly->used = false;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Drops the datagrams whose fragments did not all arrive in time.
+void ip_task(NetworkStack* stack) {
+    Time now = get_time();
+
+    for (int i = 0; i < IP_REASSEMBLY_COUNT; i++) {
+        IpReassembly* reassembly = &stack->ipv4.reassemblies[i];
+
+        if (reassembly->used && get_elapsed(reassembly->time, now) > IP_REASSEMBLY_TIMEOUT) {
+            free_reassembly(stack, reassembly);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static IpReassembly* find_oldest_reassembly(NetworkStack* stack, IpReassembly* except) {
+    IpReassembly* oldest = 0;
+    Time now = get_time();
+
+    for (int i = 0; i < IP_REASSEMBLY_COUNT; i++) {
+        IpReassembly* reassembly = &stack->ipv4.reassemblies[i];
+
+        if (reassembly->used == false || reassembly == except) {
+            continue;
+        }
+
+        if (oldest == 0 || get_elapsed(reassembly->time, now) > get_elapsed(oldest->time, now)) {
+            oldest = reassembly;
+        }
+    }
+
+    return oldest;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Finds the datagram the fragment belongs to. A new one is started if there is none, which takes the
+// place of the oldest if all are in use.
+static IpReassembly* get_reassembly(NetworkStack* stack, NetworkPacket* packet, IpHeader* header) {
+    u16 id = read_be16(&header->id);
+    IpReassembly* unused = 0;
+
+    for (int i = 0; i < IP_REASSEMBLY_COUNT; i++) {
+        IpReassembly* reassembly = &stack->ipv4.reassemblies[i];
+
+        if (reassembly->used == false) {
+            unused = reassembly;
+            continue;
+        }
+
+        if (reassembly->id == id && reassembly->senders_ip == packet->senders_ip && reassembly->target_ip == packet->target_ip && reassembly->protocol == header->protocol) {
+            return reassembly;
+        }
+    }
+
+    if (unused == 0) {
+        unused = find_oldest_reassembly(stack, 0);
+        free_reassembly(stack, unused);
+    }
+
+    unused->used = true;
+    unused->senders_ip = packet->senders_ip;
+    unused->target_ip = packet->target_ip;
+    unused->id = id;
+    unused->protocol = header->protocol;
+    unused->time = get_time();
+    unused->total_length = 0;
+    unused->received_length = 0;
+    unused->buffer_count = 0;
+    unused->fragment_count = 0;
+
+    return unused;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Inserts the fragment in order of its offset. Returns false if it overlaps one we already have, which
+// also drops duplicates.
+static bool add_fragment(IpReassembly* reassembly, NetworkPacket* packet, int offset, int length) {
+    if (reassembly->fragment_count == IP_REASSEMBLY_MAX_FRAGMENT_COUNT) {
+        return false;
+    }
+
+    int index = reassembly->fragment_count;
+
+    while (index > 0 && reassembly->offsets[index - 1] > offset) {
+        index--;
+    }
+
+    if (index > 0) {
+        NetworkPacket* before = reassembly->fragments[index - 1];
+
+        if (reassembly->offsets[index - 1] + get_network_packet_length(before) > offset) {
+            return false;
+        }
+    }
+
+    if (index < reassembly->fragment_count && offset + length > reassembly->offsets[index]) {
+        return false;
+    }
+
+    for (int i = reassembly->fragment_count; i > index; i--) {
+        reassembly->fragments[i] = reassembly->fragments[i - 1];
+        reassembly->offsets[i] = reassembly->offsets[i - 1];
+    }
+
+    reassembly->fragments[index] = packet;
+    reassembly->offsets[index] = offset;
+    reassembly->fragment_count++;
+    reassembly->received_length += length;
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Takes over a fragment whose IP header has been stripped. Returns the whole datagram once the last
+// missing fragment is in, or zero. The fragments are linked into one chain as they are, so nothing is
+// copied. The first fragment heads the chain and carries the addresses.
+static NetworkPacket* reassemble(NetworkStack* stack, NetworkPacket* packet, IpHeader* header) {
+    u16 fragment_offset = read_be16(&header->fragment_offset);
+    bool more_fragments = fragment_offset & IP_FLAG_MORE_FRAGMENTS;
+    int offset = 8 * (fragment_offset & IP_FRAGMENT_OFFSET_MASK);
+    int length = get_network_packet_length(packet);
+
+    if ((more_fragments && length % 8) || offset + length > IP_MAX_DATAGRAM_SIZE - (int)sizeof(IpHeader)) {
+        goto drop;
+    }
+
+    IpReassembly* reassembly = get_reassembly(stack, packet, header);
+
+    // Nothing may go past the end given by the last fragment, and all last fragments must agree.
+    int end = offset + length;
+
+    if (reassembly->total_length && (end > reassembly->total_length || (more_fragments == false && end != reassembly->total_length))) {
+        goto reject;
+    }
+
+    if (more_fragments == false) {
+        int count = reassembly->fragment_count;
+
+        if (count && reassembly->offsets[count - 1] + get_network_packet_length(reassembly->fragments[count - 1]) > end) {
+            free_reassembly(stack, reassembly);
+            goto drop;
+        }
+    }
+
+    int buffer_count = 0;
+
+    for (NetworkPacket* it = packet; it; it = it->next) {
+        buffer_count++;
+    }
+
+    while (stack->ipv4.buffer_count + buffer_count > IP_REASSEMBLY_BUFFER_COUNT) {
+        IpReassembly* oldest = find_oldest_reassembly(stack, reassembly);
+
+        if (oldest == 0) {
+            goto reject;
+        }
+
+        free_reassembly(stack, oldest);
+    }
+
+    if (add_fragment(reassembly, packet, offset, length) == false) {
+        goto reject;
+    }
+
+    reassembly->buffer_count += buffer_count;
+    stack->ipv4.buffer_count += buffer_count;
+
+    if (more_fragments == false) {
+        reassembly->total_length = end;
+    }
+
+    if (reassembly->total_length == 0 || reassembly->received_length != reassembly->total_length) {
+        return 0;
+    }
+
+    join_fragments(reassembly->fragments, reassembly->fragment_count);
+    NetworkPacket* datagram = reassembly->fragments[0];
+
+    // The driver can only have checked the UDP checksum of a whole datagram.
+    datagram->checksum_verified &= ~NETWORK_CHECKSUM_UDP;
+
+    stack->ipv4.buffer_count -= reassembly->buffer_count;
+    reassembly->used = false;
+
+    return datagram;
+
+    // Do not keep a datagram around which was only started by this fragment.
+    reject:
+    if (reassembly->fragment_count == 0) {
+        reassembly->used = false;
+    }
+
+    drop:
+    free_network_packet(stack, packet);
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Validates and strips the IP header. Returns the protocol, or -1 if the packet should be dropped. A
+// fragment is taken over by the reassembly, and -1 is returned with the packet set to zero. When the
+// last fragment of a datagram arrives, the packet is set to the whole datagram instead.
+static int strip_ip_header(NetworkStack* stack, NetworkPacket** packet_pointer) {
+    NetworkPacket* packet = *packet_pointer;
+
     if (packet->length <= sizeof(IpHeader)) {
-        free_network_packet(packet);
-        return;
+        return -1;
     }
 
     IpHeader* header = (IpHeader *)&packet->data[packet->index];
@@ -186,30 +713,95 @@ void handle_ip(NetworkPacket* packet) {
 
     // If the packet is too short, padding is added to reach 46 bytes in length. Because of this
     // the packet size computed by the GMAC is not always equal to the IP header packet size. 
-    packet->length = limit(packet->length, read_be16(&header->length));
+    trim_network_packet(stack, packet, read_be16(&header->length));
 
     if (verify_ip_header(header, packet->length) == false) {
-        free_network_packet(packet);
-        return;
+        return -1;
     }
 
     int header_length = sizeof(u32) * header->header_length;
 
+    // The sum of a valid header, including the checksum field, is all ones.
+    if ((packet->checksum_verified & NETWORK_CHECKSUM_IP) == 0 && compute_ip_checksum(header, header_length) != 0) {
+        return -1;
+    }
+
     packet->index += header_length;
     packet->length -= header_length;
 
-    if (should_filter_away(packet)) {
-        free_network_packet(packet);
-        return;
+    if (should_filter_away(stack, packet)) {
+        return -1;
     }
 
-    if (header->protocol == IP_PROTOCOL_UDP) {
-        handle_udp(packet);
+#if ARP_GLEAN_FROM_IP
+    // The MAC header is still in the buffer right in front of the IP header.
+    MacHeader* mac_header = (MacHeader *)((u8 *)header - sizeof(MacHeader));
+
+    if ((mac_header->target_mac.address[0] & 1) == 0) {
+        arp_glean(stack, packet->senders_ip, &mac_header->senders_mac);
     }
-    else if (header->protocol == IP_PROTOCOL_ICMP) {
-        handle_icmp(packet);
+#endif
+
+    if (read_be16(&header->fragment_offset) & (IP_FLAG_MORE_FRAGMENTS | IP_FRAGMENT_OFFSET_MASK)) {
+        // The reassembly may free the packet, so the protocol is read first.
+        int protocol = header->protocol;
+        *packet_pointer = reassemble(stack, packet, header);
+
+        return (*packet_pointer) ? protocol : -1;
+    }
+
+    return header->protocol;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void handle_ip(NetworkStack* stack, NetworkPacket* packet) {
+    int protocol = strip_ip_header(stack, &packet);
+
+    if (protocol == IP_PROTOCOL_UDP) {
+        handle_udp(stack, packet);
+    }
+    else if (protocol == IP_PROTOCOL_ICMP) {
+        handle_icmp(stack, packet);
+    }
+    else if (protocol == IP_PROTOCOL_IGMP) {
+        handle_igmp(stack, packet);
     }
     else {
-        free_network_packet(packet);
+        free_network_packet(stack, packet);
     }
 }
+
+//--------------------------------------------------------------------------------------------------
+
+// Same as handle_ip, but the UDP packets of the whole burst are passed on to the UDP layer together,
+// in parts of NETWORK_BURST_SIZE.
+void handle_ip_burst(NetworkStack* stack, NetworkPacket** packets, int count) {
+    NetworkPacket* udp_packets[NETWORK_BURST_SIZE];
+    int udp_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        NetworkPacket* packet = packets[i];
+        int protocol = strip_ip_header(stack, &packet);
+
+        if (protocol == IP_PROTOCOL_UDP) {
+            if (udp_count == NETWORK_BURST_SIZE) {
+                handle_udp_burst(stack, udp_packets, udp_count);
+                udp_count = 0;
+            }
+
+            udp_packets[udp_count++] = packet;
+        }
+        else if (protocol == IP_PROTOCOL_ICMP) {
+            handle_icmp(stack, packet);
+        }
+        else if (protocol == IP_PROTOCOL_IGMP) {
+            handle_igmp(stack, packet);
+        }
+        else {
+            free_network_packet(stack, packet);
+        }
+    }
+
+    handle_udp_burst(stack, udp_packets, udp_count);
+}
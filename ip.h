@@ -5,19 +5,129 @@
 
 #include "utilities.h"
 #include "network.h"
+#include "time.h"
+
+//--------------------------------------------------------------------------------------------------
+
+// Largest datagram, including the IP header, which is sent as fragments or reassembled.
+#ifndef IP_MAX_DATAGRAM_SIZE
+#define IP_MAX_DATAGRAM_SIZE  8192
+#endif
+
+// Largest IP payload which fits in one frame.
+#define IP_MAX_PAYLOAD_SIZE  (NETWORK_MTU - 20)
+
+// Every fragment but the last carries a multiple of 8 bytes.
+#define IP_FRAGMENT_SIZE       (IP_MAX_PAYLOAD_SIZE & ~7)
+#define IP_MAX_FRAGMENT_COUNT  ((IP_MAX_DATAGRAM_SIZE - 20 + IP_FRAGMENT_SIZE - 1) / IP_FRAGMENT_SIZE)
+
+// Datagrams being reassembled at the same time. When all are in use, the oldest is dropped.
+#ifndef IP_REASSEMBLY_COUNT
+#define IP_REASSEMBLY_COUNT  4
+#endif
+
+// Bounds the packet buffers held by all the reassemblies together, so fragments can not starve the
+// RX ring. The oldest reassembly is dropped to make room.
+#ifndef IP_REASSEMBLY_BUFFER_COUNT
+#define IP_REASSEMBLY_BUFFER_COUNT  32
+#endif
+
+// TTL of the datagrams we send to a group. One keeps them on the local network.
+#ifndef IP_MULTICAST_TIME_TO_LIVE
+#define IP_MULTICAST_TIME_TO_LIVE  1
+#endif
+
+// Senders with a small MTU split a datagram into more fragments than we do.
+#define IP_REASSEMBLY_MAX_FRAGMENT_COUNT  16
 
 //--------------------------------------------------------------------------------------------------
 
 enum {
     IP_PROTOCOL_UDP  = 17,
     IP_PROTOCOL_ICMP = 1,
+    IP_PROTOCOL_IGMP = 2,
+};
+
+// The fragment offset field holds the flags in the top three bits, and the offset in units of 8 bytes
+// in the rest.
+enum {
+    IP_FLAG_DONT_FRAGMENT   = 1 << 14,
+    IP_FLAG_MORE_FRAGMENTS  = 1 << 13,
+    IP_FRAGMENT_OFFSET_MASK = 0x1FFF,
 };
 
+typedef struct PACKED {
+    u8   header_length                      : 4;
+    u8   version                            : 4;
+    u8   explicit_congestion_notification   : 2;
+    u8   differentiated_services_code_point : 6;
+    u16  length;
+    u16  id;
+    u16  fragment_offset;
+    u8   time_to_live;
+    u8   protocol;
+    u16  checksum;
+    u32  senders_ip;
+    u32  target_ip;
+} IpHeader;
+
+// A datagram whose fragments are being collected. The fragments are kept in order of their offset,
+// with the IP header stripped.
+typedef struct {
+    bool used;
+
+    Ip senders_ip;
+    Ip target_ip;
+    u16 id;
+    u8 protocol;
+
+    // When the first fragment arrived.
+    Time time;
+
+    // Payload length of the whole datagram. Zero until the last fragment has arrived.
+    int total_length;
+    int received_length;
+    int buffer_count;
+
+    int fragment_count;
+    NetworkPacket* fragments[IP_REASSEMBLY_MAX_FRAGMENT_COUNT];
+    u16 offsets[IP_REASSEMBLY_MAX_FRAGMENT_COUNT];
+} IpReassembly;
+
+typedef struct {
+    IpReassembly reassemblies[IP_REASSEMBLY_COUNT];
+    int buffer_count;
+
+    // The constant fields of the headers we send and their checksum sum, for our IP in template_ip.
+    IpHeader header_template;
+    u32 template_sum;
+    Ip template_ip;
+    bool template_valid;
+
+    u16 next_id;
+} Ipv4;
+
 //--------------------------------------------------------------------------------------------------
 
 Ip string_to_ip(const char* string);
 void ip_to_string(Ip ip, char* string);
-void handle_ip(NetworkPacket* packet);
-void ip_send(NetworkPacket* packet, Ip ip, int protocol);
+void ip_init(NetworkStack* stack);
+void ip_task(NetworkStack* stack);
+u16 ip_next_id(NetworkStack* stack);
+bool ip_is_multicast(Ip ip);
+void ip_to_multicast_mac(Ip ip, Mac* mac);
+void handle_ip(NetworkStack* stack, NetworkPacket* packet);
+void handle_ip_burst(NetworkStack* stack, NetworkPacket** packets, int count);
+
+// Datagrams longer than IP_MAX_PAYLOAD_SIZE are sent as fragments. Returns false, and sends nothing,
+// for datagrams longer than IP_MAX_DATAGRAM_SIZE.
+bool ip_send(NetworkStack* stack, NetworkPacket* packet, Ip ip, int protocol);
+
+// Sends packets to the same destination. The address is only resolved once. Returns the number of
+// packets handed to the driver. The remaining packets are given back without the IP header. Nothing
+// is sent until the MAC of the next hop is known.
+int ip_send_burst(NetworkStack* stack, NetworkPacket** packets, int count, Ip ip, int protocol);
+
+bool ip_write_header_template(NetworkStack* stack, u8* template, Ip ip, int protocol);
 
 #endif
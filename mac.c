@@ -7,14 +7,6 @@
 
 //--------------------------------------------------------------------------------------------------
 
-typedef struct PACKED {
-    Mac target_mac;
-    Mac senders_mac;
-    u16 ether_type;
-} MacHeader;
-
-//--------------------------------------------------------------------------------------------------
-
 static u8 char_to_hex(char c) {
     if ('0' <= c && c <= '9') {
         return c - '0';
@@ -65,38 +57,50 @@ void mac_to_string(const Mac* mac, char* string, bool lowercase) {
 
 //--------------------------------------------------------------------------------------------------
 
-void mac_send(NetworkPacket* packet, const Mac* mac, u16 ether_type) {
+void mac_write_header(NetworkStack* stack, MacHeader* header, const Mac* mac, u16 ether_type) {
+    memory_copy(mac, &header->target_mac, sizeof(Mac));
+    memory_copy(get_our_mac(stack), &header->senders_mac, sizeof(Mac));
+    write_be16(ether_type, &header->ether_type);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns false if the driver could not take the frame. The packet is then handed back to the caller
+// as it was passed in.
+bool mac_send(NetworkStack* stack, NetworkPacket* packet, const Mac* mac, u16 ether_type) {
     packet->length += sizeof(MacHeader);
     packet->index -= sizeof(MacHeader);
 
-    MacHeader* header = (MacHeader *)&packet->data[packet->index];
+    mac_write_header(stack, (MacHeader *)&packet->data[packet->index], mac, ether_type);
 
-    memory_copy(mac, &header->target_mac, sizeof(Mac));
-    memory_copy(get_our_mac(), &header->senders_mac, sizeof(Mac));
-    write_be16(ether_type, &header->ether_type);
-    
-    gmac_send(packet);
+    if (gmac_send(stack, packet) == false) {
+        packet->length -= sizeof(MacHeader);
+        packet->index += sizeof(MacHeader);
+        return false;
+    }
+
+    return true;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void mac_broadcast(NetworkPacket* packet, u16 ether_type) {
+bool mac_broadcast(NetworkStack* stack, NetworkPacket* packet, u16 ether_type) {
     const Mac mac = { .address = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } };
-    mac_send(packet, &mac, ether_type);
+    return mac_send(stack, packet, &mac, ether_type);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void mac_send_to_ip(NetworkPacket* packet, Ip ip) {
-    arp_send(packet, ip);
+bool mac_send_to_ip(NetworkStack* stack, NetworkPacket* packet, Ip ip) {
+    return arp_send(stack, packet, ip);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void handle_mac(NetworkPacket* packet) {
+// Returns the ether type and moves the packet past the MAC header. Returns zero for runt frames.
+static u16 strip_mac_header(NetworkPacket* packet) {
     if (packet->length <= sizeof(MacHeader)) {
-        free_network_packet(packet);
-        return;
+        return 0;
     }
 
     MacHeader* header = (MacHeader *)&packet->data[packet->index];
@@ -104,15 +108,54 @@ void handle_mac(NetworkPacket* packet) {
     packet->length -= sizeof(MacHeader);
     packet->index += sizeof(MacHeader);
 
-    u16 ether_type = read_be16(&header->ether_type);
+    return read_be16(&header->ether_type);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void handle_mac(NetworkStack* stack, NetworkPacket* packet) {
+    u16 ether_type = strip_mac_header(packet);
 
     if (ether_type == ETHER_TYPE_ARP) {
-        handle_arp(packet);
+        handle_arp(stack, packet);
     }
     else if (ether_type == ETHER_TYPE_IPV4) {
-        handle_ip(packet);
+        handle_ip(stack, packet);
     }
     else {
-        free_network_packet(packet);
+        free_network_packet(stack, packet);
     }
 }
+
+//--------------------------------------------------------------------------------------------------
+
+// Processes a burst of received frames one layer at a time. The IPv4 frames are collected and handed
+// to the IP layer together, which keeps the code and data of each layer in the cache for the whole
+// burst. ARP is rare, so it is handled right away. Bursts longer than NETWORK_BURST_SIZE are passed on
+// in parts.
+void handle_mac_burst(NetworkStack* stack, NetworkPacket** packets, int count) {
+    NetworkPacket* ip_packets[NETWORK_BURST_SIZE];
+    int ip_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        NetworkPacket* packet = packets[i];
+        u16 ether_type = strip_mac_header(packet);
+
+        if (ether_type == ETHER_TYPE_IPV4) {
+            if (ip_count == NETWORK_BURST_SIZE) {
+                handle_ip_burst(stack, ip_packets, ip_count);
+                ip_count = 0;
+            }
+
+            ip_packets[ip_count++] = packet;
+        }
+        else if (ether_type == ETHER_TYPE_ARP) {
+            handle_arp(stack, packet);
+        }
+        else {
+            free_network_packet(stack, packet);
+        }
+    }
+
+    handle_ip_burst(stack, ip_packets, ip_count);
+}
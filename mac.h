@@ -13,13 +13,21 @@ enum {
     ETHER_TYPE_ARP  = 0x0806,
 };
 
+typedef struct PACKED {
+    Mac target_mac;
+    Mac senders_mac;
+    u16 ether_type;
+} MacHeader;
+
 //--------------------------------------------------------------------------------------------------
 
 Mac string_to_mac(const char* string);
 void mac_to_string(const Mac* mac, char* string, bool lowercase);
-void mac_send(NetworkPacket* packet, const Mac* mac, u16 ether_type);
-void mac_broadcast(NetworkPacket* packet, u16 ether_type);
-void mac_send_to_ip(NetworkPacket* packet, Ip ip);
-void handle_mac();
+void mac_write_header(NetworkStack* stack, MacHeader* header, const Mac* mac, u16 ether_type);
+bool mac_send(NetworkStack* stack, NetworkPacket* packet, const Mac* mac, u16 ether_type);
+bool mac_broadcast(NetworkStack* stack, NetworkPacket* packet, u16 ether_type);
+bool mac_send_to_ip(NetworkStack* stack, NetworkPacket* packet, Ip ip);
+void handle_mac(NetworkStack* stack, NetworkPacket* packet);
+void handle_mac_burst(NetworkStack* stack, NetworkPacket** packets, int count);
 
 #endif
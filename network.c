@@ -1,110 +1,341 @@
 // Copyright (c) 2021 Bjørn Brodtkorb
 
 #include "network.h"
+#include "stack.h"
 #include "arp.h"
 #include "mac.h"
 #include "gmac.h"
 #include "udp.h"
 #include "dhcp.h"
+#include "route.h"
+#include "ip.h"
+#include "igmp.h"
+#include "filter.h"
+#include "checksum.h"
 
 //--------------------------------------------------------------------------------------------------
 
-#define NETWORK_PACKET_COUNT 96
+// Hands the buffers to the packets starting at first_packet and puts them in the pool of the class.
+static int init_pool(NetworkStack* stack, int size_class, int first_packet, u8* buffers, int count, int size, int header_size, int reserve_count) {
+    NetworkPacketPool* pool = &stack->network_packet_pools[size_class];
+
+    list_init(&pool->free_packets);
+    pool->free_count = count;
+    pool->reserve_count = reserve_count;
+    pool->size = size;
+    pool->header_size = header_size;
+
+    for (int i = 0; i < count; i++) {
+        NetworkPacket* packet = &stack->network_packets[first_packet + i];
+
+        packet->data = &buffers[i * size];
+        packet->size = size;
+        packet->size_class = size_class;
+        list_add_first(&packet->list_node, &pool->free_packets);
+    }
+
+    return first_packet + count;
+}
 
 //--------------------------------------------------------------------------------------------------
 
-static NetworkPacket network_packets[NETWORK_PACKET_COUNT];
-static List free_network_packets;
+void network_init(NetworkStack* stack) {
+    int next = 0;
 
-static Mac our_mac;
-static Ip our_ip;
-static Ip our_netmask;
+    next = init_pool(stack, NETWORK_PACKET_CLASS_SMALL, next, &stack->small_packet_buffers[0][0], NETWORK_SMALL_PACKET_COUNT, NETWORK_PACKET_SMALL_SIZE, NETWORK_PACKET_SMALL_HEADER_SIZE, NETWORK_PACKET_RESERVE_COUNT);
+    next = init_pool(stack, NETWORK_PACKET_CLASS_MEDIUM, next, &stack->medium_packet_buffers[0][0], NETWORK_MEDIUM_PACKET_COUNT, NETWORK_PACKET_SIZE, NETWORK_PACKET_HEADER_SIZE, NETWORK_PACKET_RESERVE_COUNT);
+    next = init_pool(stack, NETWORK_PACKET_CLASS_LARGE, next, &stack->large_packet_buffers[0][0], NETWORK_LARGE_PACKET_COUNT, NETWORK_PACKET_LARGE_SIZE, NETWORK_PACKET_HEADER_SIZE, 0);
+
+    stack->our_ip = 0;
+    stack->our_netmask = 0;
+    stack->tx_checksum_offload = false;
+
+    filter_init(stack);
+    route_init(stack);
+    ip_init(stack);
+    igmp_init(stack);
+    arp_init(stack);
+    udp_init(stack);
+    dhcp_init(stack);
+}
 
 //--------------------------------------------------------------------------------------------------
 
-void network_init() {
-    list_init(&free_network_packets);
+// Takes a packet from the smallest size class that fits. If that class has run out, a bigger one is
+// used instead.
+static NetworkPacket* allocate_packet(NetworkStack* stack, int size, bool use_reserve) {
+    for (int i = 0; i < NETWORK_PACKET_CLASS_COUNT; i++) {
+        NetworkPacketPool* pool = &stack->network_packet_pools[i];
 
-    for (int i = 0; i < NETWORK_PACKET_COUNT; i++) {
-        list_add_first(&network_packets[i].list_node, &free_network_packets);
+        if (pool->size - pool->header_size < size) {
+            continue;
+        }
+
+        if (pool->free_count <= ((use_reserve) ? 0 : pool->reserve_count)) {
+            continue;
+        }
+
+        ListNode* node = list_remove_first(&pool->free_packets);
+        pool->free_count--;
+
+        NetworkPacket* packet = get_struct_containing_list_node(node, NetworkPacket, list_node);
+        packet->length = 0;
+        packet->index = pool->header_size;
+        packet->next = 0;
+        packet->checksum_verified = 0;
+
+        return packet;
     }
 
-    arp_init();
-    udp_init();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// May dip into the reserve. Returns zero if all packets big enough have been allocated.
+NetworkPacket* allocate_reserved_network_packet(NetworkStack* stack, int size) {
+    return allocate_packet(stack, size, true);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns zero if only the reserve is left. The caller must drop what it was going to send.
+NetworkPacket* allocate_network_packet(NetworkStack* stack, int size) {
+    return allocate_packet(stack, size, false);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-NetworkPacket* allocate_network_packet() {
-    ListNode* node = list_remove_first(&free_network_packets);
+// Frees the whole chain.
+void free_network_packet(NetworkStack* stack, NetworkPacket* packet) {
+    while (packet) {
+        NetworkPacket* next = packet->next;
+        NetworkPacketPool* pool = &stack->network_packet_pools[packet->size_class];
 
-    // All packets have been allocated.
-    if (node == 0) {
-        while (1);
+        list_add_first(&packet->list_node, &pool->free_packets);
+        pool->free_count++;
+
+        packet = next;
     }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int get_network_packet_length(NetworkPacket* packet) {
+    int length = 0;
 
-    NetworkPacket* packet = get_struct_containing_list_node(node, NetworkPacket, list_node);
-    packet->length = 0;
-    packet->index = NETWORK_PACKET_HEADER_SIZE;
-    
-    return packet;
+    for (; packet; packet = packet->next) {
+        length += packet->length;
+    }
+
+    return length;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void free_network_packet(NetworkPacket* packet) {
-    list_add_first(&packet->list_node, &free_network_packets);
+// Copies the data to the end of the chain, linking in new buffers as needed. If sum is given, the data
+// is also added to it. Returns false if the pool ran out, with some of the data maybe added.
+static bool append_data(NetworkStack* stack, NetworkPacket* packet, const void* data, int size, bool use_reserve, u32* sum) {
+    const u8* source = data;
+    bool odd = false;
+
+    while (packet->next) {
+        packet = packet->next;
+    }
+
+    while (size) {
+        int space = packet->size - packet->index - packet->length;
+
+        if (space == 0) {
+            int request = limit(size, NETWORK_PACKET_USER_SIZE);
+            NetworkPacket* next = allocate_packet(stack, request, use_reserve);
+
+            if (next == 0) {
+                return false;
+            }
+
+            // Only the first packet needs room for the headers.
+            next->index = 0;
+            packet->next = next;
+            packet = next;
+            continue;
+        }
+
+        int count = limit(space, size);
+        u8* dest = (u8 *)&packet->data[packet->index + packet->length];
+
+        if (sum) {
+            u32 partial = checksum_copy(0, source, dest, count);
+            *sum += (odd) ? checksum_swap(partial) : partial;
+            odd ^= count & 1;
+        } else {
+            memory_copy(source, dest, count);
+        }
+
+        packet->length += count;
+        source += count;
+        size -= count;
+    }
+
+    return true;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void network_task() {
-    for (int i = 0; i < RECEIVE_DESCRIPTOR_COUNT; i++) {
-        NetworkPacket* packet = gmac_receive();
-        if (packet == 0) {
-            break;
+bool append_to_network_packet(NetworkStack* stack, NetworkPacket* packet, const void* data, int size, bool use_reserve) {
+    return append_data(stack, packet, data, size, use_reserve, 0);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Same as append_to_network_packet, but the data is summed while it is copied. The partial sum is
+// added to sum, so the caller does not have to read the data again to compute a checksum. Does not
+// use the reserve.
+bool append_to_network_packet_with_checksum(NetworkStack* stack, NetworkPacket* packet, const void* data, int size, u32* sum) {
+    return append_data(stack, packet, data, size, false, sum);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Copies up to size bytes from the chain, starting offset bytes into the data. Returns the number of
+// bytes copied.
+int copy_from_network_packet(NetworkPacket* packet, int offset, void* data, int size) {
+    u8* dest = data;
+    int copied = 0;
+
+    for (; packet && copied < size; packet = packet->next) {
+        if (offset >= packet->length) {
+            offset -= packet->length;
+            continue;
+        }
+
+        int count = limit(packet->length - offset, size - copied);
+        memory_copy((u8 *)&packet->data[packet->index + offset], dest + copied, count);
+
+        copied += count;
+        offset = 0;
+    }
+
+    return copied;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Cuts the chain down to the given total length. Buffers which are no longer needed are freed.
+void trim_network_packet(NetworkStack* stack, NetworkPacket* packet, int length) {
+    while (packet) {
+        if (packet->length >= length) {
+            packet->length = length;
+            free_network_packet(stack, packet->next);
+            packet->next = 0;
+            return;
         }
 
-        handle_mac(packet);
+        length -= packet->length;
+        packet = packet->next;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Cuts the chain after length bytes, which must be less than the length of the chain, and returns
+// the rest as a chain of its own. The rest starts with a new packet with room for the headers. The
+// bytes after the cut in the buffer it falls in are copied to it, and the buffers after that are moved
+// over as they are. Returns zero if the pool ran out, in which case the chain is unchanged.
+NetworkPacket* split_network_packet(NetworkStack* stack, NetworkPacket* packet, int length) {
+    while (packet->length < length) {
+        length -= packet->length;
+        packet = packet->next;
+    }
+
+    int tail = packet->length - length;
+    NetworkPacket* rest = allocate_network_packet(stack, limit(tail, NETWORK_PACKET_MAX_USER_SIZE));
+
+    if (rest == 0) {
+        return 0;
+    }
+
+    if (append_to_network_packet(stack, rest, (u8 *)&packet->data[packet->index + length], tail, false) == false) {
+        free_network_packet(stack, rest);
+        return 0;
+    }
+
+    link_network_packet(rest, packet->next);
+    packet->next = 0;
+    packet->length = length;
+
+    return rest;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Links next in after the last buffer of the chain.
+void link_network_packet(NetworkPacket* packet, NetworkPacket* next) {
+    while (packet->next) {
+        packet = packet->next;
     }
 
-    arp_task();
-    dhcp_task();
+    packet->next = next;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void network_task(NetworkStack* stack) {
+    NetworkPacket* packets[NETWORK_BURST_SIZE];
+
+    int count = gmac_receive_burst(stack, packets, NETWORK_BURST_SIZE);
+    handle_mac_burst(stack, packets, count);
+
+    arp_task(stack);
+    ip_task(stack);
+    igmp_task(stack);
+    dhcp_task(stack);
+
+    // Everything sent while handling the burst goes out with a single doorbell.
+    network_flush(stack);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void network_flush(NetworkStack* stack) {
+    gmac_flush(stack);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void set_our_mac(const Mac* mac) {
-    memory_copy(mac, &our_mac, sizeof(Mac));
-    gmac_set_mac_address(mac);
+void set_our_mac(NetworkStack* stack, const Mac* mac) {
+    memory_copy(mac, &stack->our_mac, sizeof(Mac));
+    gmac_set_mac_address(stack, mac);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-Mac* get_our_mac() {
-    return &our_mac;
+Mac* get_our_mac(NetworkStack* stack) {
+    return &stack->our_mac;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void set_our_ip(Ip ip) {
-    our_ip = ip;
+void set_our_ip(NetworkStack* stack, Ip ip) {
+    stack->our_ip = ip;
+    route_update_connected(stack);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-Ip get_our_ip() {
-    return our_ip;
+Ip get_our_ip(NetworkStack* stack) {
+    return stack->our_ip;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void set_our_netmask(Ip netmask) {
-    our_netmask = netmask;
+void set_our_netmask(NetworkStack* stack, Ip netmask) {
+    stack->our_netmask = netmask;
+    route_update_connected(stack);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-Ip get_our_netmask() {
-    return our_netmask;
+Ip get_our_netmask(NetworkStack* stack) {
+    return stack->our_netmask;
 }
@@ -8,9 +8,31 @@
 
 //--------------------------------------------------------------------------------------------------
 
-#define NETWORK_PACKET_SIZE         1024
-#define NETWORK_PACKET_HEADER_SIZE  144
-#define NETWORK_PACKET_USER_SIZE   (NETWORK_PACKET_SIZE - NETWORK_PACKET_HEADER_SIZE)
+// Packets come in three size classes. The small ones are meant for control traffic like ARP and
+// acknowledgements, the medium ones are used by the RX rings, and the large ones carry a full MTU.
+#define NETWORK_PACKET_SMALL_SIZE         192
+#define NETWORK_PACKET_SMALL_HEADER_SIZE  64
+#define NETWORK_PACKET_SIZE               1024
+#define NETWORK_PACKET_LARGE_SIZE         1616
+#define NETWORK_PACKET_HEADER_SIZE        144
+
+#define NETWORK_PACKET_USER_SIZE      (NETWORK_PACKET_SIZE - NETWORK_PACKET_HEADER_SIZE)
+#define NETWORK_PACKET_MAX_USER_SIZE  (NETWORK_PACKET_LARGE_SIZE - NETWORK_PACKET_HEADER_SIZE)
+
+// Frames bigger than a packet buffer are carried by a chain of packets. Set NETWORK_MTU above 1500 to
+// enable jumbo frames.
+#ifndef NETWORK_MTU
+#define NETWORK_MTU  1500
+#endif
+
+#define NETWORK_MAX_FRAME_SIZE  (NETWORK_MTU + 14)
+
+// Maximum number of frames taken from the driver and processed together by network_task.
+#define NETWORK_BURST_SIZE  32
+
+// Checksums of a received frame the driver has already verified. See NetworkPacket.
+#define NETWORK_CHECKSUM_IP   (1 << 0)
+#define NETWORK_CHECKSUM_UDP  (1 << 1)
 
 //--------------------------------------------------------------------------------------------------
 
@@ -21,13 +43,30 @@ typedef struct {
 typedef u32 Ip;
 typedef u16 Port;
 
-typedef struct {
-    volatile u8 data[1024];
+// The full definition lives in stack.h. Every layer takes the stack it operates on, so that several
+// independent stacks (e.g. one per interface or core) can live in the same image.
+typedef struct NetworkStack NetworkStack;
+
+typedef struct NetworkPacket {
+    volatile u8* data;
+    int size;
     int index;
     int length;
 
-    // Set by the GMAC hardware for incoming packets.
+    // The rest of the frame if it does not fit in this buffer. The headers are always in the first
+    // packet of the chain, and the length only counts the bytes in this buffer.
+    struct NetworkPacket* next;
+
+    // Which pool the packet is returned to.
+    u8 size_class;
+
+    // Set by the GMAC hardware for incoming packets. Multicast frames are only passed on if they match
+    // the filter set with gmac_set_multicast_filter, which may let other groups through as well.
     bool broadcast;
+    bool multicast;
+
+    // Set by the driver for incoming packets. The stack only computes the checksums not listed here.
+    u8 checksum_verified;
 
     Ip senders_ip;
     Ip target_ip;
@@ -38,19 +77,34 @@ typedef struct {
 
 //--------------------------------------------------------------------------------------------------
 
-void network_init();
-NetworkPacket* allocate_network_packet();
-void free_network_packet(NetworkPacket* packet);
+void network_init(NetworkStack* stack);
+// The size is the number of bytes the caller will put in the packet, not counting the headers added
+// by the lower layers. The smallest size class that fits is used.
+NetworkPacket* allocate_network_packet(NetworkStack* stack, int size);
+NetworkPacket* allocate_reserved_network_packet(NetworkStack* stack, int size);
+void free_network_packet(NetworkStack* stack, NetworkPacket* packet);
+
+int get_network_packet_length(NetworkPacket* packet);
+bool append_to_network_packet(NetworkStack* stack, NetworkPacket* packet, const void* data, int size, bool use_reserve);
+bool append_to_network_packet_with_checksum(NetworkStack* stack, NetworkPacket* packet, const void* data, int size, u32* sum);
+int copy_from_network_packet(NetworkPacket* packet, int offset, void* data, int size);
+void trim_network_packet(NetworkStack* stack, NetworkPacket* packet, int length);
+NetworkPacket* split_network_packet(NetworkStack* stack, NetworkPacket* packet, int length);
+void link_network_packet(NetworkPacket* packet, NetworkPacket* next);
+
+void network_task(NetworkStack* stack);
 
-void network_task();
+// Sent frames are queued in the driver and started by network_flush. network_task flushes at the end
+// of every pass, so only code sending outside of it needs to call this.
+void network_flush(NetworkStack* stack);
 
-void set_our_mac(const Mac* mac);
-Mac* get_our_mac();
+void set_our_mac(NetworkStack* stack, const Mac* mac);
+Mac* get_our_mac(NetworkStack* stack);
 
-void set_our_ip(Ip ip);
-Ip get_our_ip();
+void set_our_ip(NetworkStack* stack, Ip ip);
+Ip get_our_ip(NetworkStack* stack);
 
-void set_our_netmask(Ip netmask);
-Ip get_our_netmask();
+void set_our_netmask(NetworkStack* stack, Ip netmask);
+Ip get_our_netmask(NetworkStack* stack);
 
 #endif
@@ -0,0 +1,157 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+#include "route.h"
+#include "network.h"
+#include "stack.h"
+
+//--------------------------------------------------------------------------------------------------
+
+static RouteCacheEntry* get_cache_entry(NetworkStack* stack, Ip ip) {
+    return &stack->routing.cache[(ip * 2654435761u) >> (32 - ROUTE_CACHE_BITS)];
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool comes_before(const RouteEntry* entry, const RouteEntry* other) {
+    if (entry->prefix_length != other->prefix_length) {
+        return entry->prefix_length > other->prefix_length;
+    }
+
+    return entry->origin < other->origin;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int find_entry(Routing* routing, Ip destination, Ip netmask, RouteOrigin origin) {
+    for (int i = 0; i < routing->entry_count; i++) {
+        RouteEntry* entry = &routing->entries[i];
+
+        if (entry->destination == destination && entry->netmask == netmask && entry->origin == origin) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void remove_entry(Routing* routing, int index) {
+    for (int i = index + 1; i < routing->entry_count; i++) {
+        routing->entries[i - 1] = routing->entries[i];
+    }
+
+    routing->entry_count--;
+    routing->generation++;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void route_init(NetworkStack* stack) {
+    Routing* routing = &stack->routing;
+
+    routing->entry_count = 0;
+    routing->generation = 1;
+
+    // Generation zero is never used, so the cache starts out empty.
+    for (int i = 0; i < ROUTE_CACHE_COUNT; i++) {
+        routing->cache[i].generation = 0;
+    }
+
+    route_update_connected(stack);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool route_add(NetworkStack* stack, Ip destination, Ip netmask, Ip gateway, RouteOrigin origin) {
+    Routing* routing = &stack->routing;
+    destination &= netmask;
+
+    int index = find_entry(routing, destination, netmask, origin);
+
+    if (index >= 0) {
+        remove_entry(routing, index);
+    }
+
+    if (routing->entry_count == ROUTE_COUNT) {
+        return false;
+    }
+
+    RouteEntry entry = {
+        .destination = destination,
+        .netmask = netmask,
+        .gateway = gateway,
+        .prefix_length = __builtin_popcount(netmask),
+        .origin = origin,
+    };
+
+    // Keep the table ordered by moving the entries which come after the new one up.
+    int i = routing->entry_count;
+
+    for (; i > 0 && comes_before(&entry, &routing->entries[i - 1]); i--) {
+        routing->entries[i] = routing->entries[i - 1];
+    }
+
+    routing->entries[i] = entry;
+    routing->entry_count++;
+    routing->generation++;
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void route_remove(NetworkStack* stack, Ip destination, Ip netmask, RouteOrigin origin) {
+    Routing* routing = &stack->routing;
+    int index = find_entry(routing, destination & netmask, netmask, origin);
+
+    if (index >= 0) {
+        remove_entry(routing, index);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Before the interface is configured the netmask is zero, so everything is on our link.
+void route_update_connected(NetworkStack* stack) {
+    Routing* routing = &stack->routing;
+
+    for (int i = 0; i < routing->entry_count; i++) {
+        if (routing->entries[i].origin == ROUTE_ORIGIN_CONNECTED) {
+            remove_entry(routing, i);
+            break;
+        }
+    }
+
+    Ip netmask = get_our_netmask(stack);
+    route_add(stack, get_our_ip(stack), netmask, 0, ROUTE_ORIGIN_CONNECTED);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+Ip route_lookup(NetworkStack* stack, Ip ip) {
+    Routing* routing = &stack->routing;
+    RouteCacheEntry* cached = get_cache_entry(stack, ip);
+
+    if (cached->generation == routing->generation && cached->destination == ip) {
+        return cached->next_hop;
+    }
+
+    Ip next_hop = 0;
+
+    for (int i = 0; i < routing->entry_count; i++) {
+        RouteEntry* entry = &routing->entries[i];
+
+        if ((ip & entry->netmask) == entry->destination) {
+            next_hop = (entry->gateway) ? entry->gateway : ip;
+            break;
+        }
+    }
+
+    // Misses are cached as well, so unreachable destinations do not scan the table every time.
+    cached->destination = ip;
+    cached->next_hop = next_hop;
+    cached->generation = routing->generation;
+
+    return next_hop;
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include "utilities.h"
+#include "network.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#ifndef ROUTE_COUNT
+#define ROUTE_COUNT 8
+#endif
+
+// Recently used destinations and their next hop. Direct mapped on a hash of the IP.
+#define ROUTE_CACHE_BITS   4
+#define ROUTE_CACHE_COUNT  (1 << ROUTE_CACHE_BITS)
+
+//--------------------------------------------------------------------------------------------------
+
+// Where a route came from. When two routes have the same prefix length, the lowest origin wins.
+typedef enum {
+    ROUTE_ORIGIN_STATIC,
+    ROUTE_ORIGIN_DHCP,
+    ROUTE_ORIGIN_CONNECTED,
+} RouteOrigin;
+
+typedef struct {
+    Ip destination;
+    Ip netmask;
+
+    // Zero if the destination is on our link. Otherwise the router, which must be on our link.
+    Ip gateway;
+
+    u8 prefix_length;
+    u8 origin;
+} RouteEntry;
+
+typedef struct {
+    Ip destination;
+    Ip next_hop;
+    u32 generation;
+} RouteCacheEntry;
+
+typedef struct {
+    // Ordered from the longest to the shortest prefix, so the first match is the best one.
+    RouteEntry entries[ROUTE_COUNT];
+    int entry_count;
+
+    RouteCacheEntry cache[ROUTE_CACHE_COUNT];
+
+    // Incremented whenever the table changes. Cached next hops from an older generation are stale.
+    u32 generation;
+} Routing;
+
+//--------------------------------------------------------------------------------------------------
+
+void route_init(NetworkStack* stack);
+
+// Replaces the route with the same destination, netmask and origin. Returns false if the table is
+// full.
+bool route_add(NetworkStack* stack, Ip destination, Ip netmask, Ip gateway, RouteOrigin origin);
+void route_remove(NetworkStack* stack, Ip destination, Ip netmask, RouteOrigin origin);
+
+// Installs the route to our own subnet. Called whenever our IP or netmask changes.
+void route_update_connected(NetworkStack* stack);
+
+// Returns the IP to resolve for sending to the destination. This is the destination itself if it is
+// on our link, and the router if not. Returns zero if there is no route.
+Ip route_lookup(NetworkStack* stack, Ip ip);
+
+#endif
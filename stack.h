@@ -0,0 +1,79 @@
+// Copyright (c) 2021 Bjørn Brodtkorb
+
+#ifndef STACK_H
+#define STACK_H
+
+#include "utilities.h"
+#include "stdalign.h"
+#include "list.h"
+#include "network.h"
+#include "arp.h"
+#include "udp.h"
+#include "dhcp.h"
+#include "route.h"
+#include "ip.h"
+#include "igmp.h"
+#include "filter.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define NETWORK_SMALL_PACKET_COUNT   64
+#define NETWORK_MEDIUM_PACKET_COUNT  80
+#define NETWORK_LARGE_PACKET_COUNT   8
+#define NETWORK_PACKET_COUNT        (NETWORK_SMALL_PACKET_COUNT + NETWORK_MEDIUM_PACKET_COUNT + NETWORK_LARGE_PACKET_COUNT)
+
+// Packets of the small and medium class only handed out by allocate_reserved_network_packet. This
+// keeps the RX ring and the control traffic going when the application holds on to all the others.
+#define NETWORK_PACKET_RESERVE_COUNT 8
+
+//--------------------------------------------------------------------------------------------------
+
+enum {
+    NETWORK_PACKET_CLASS_SMALL,
+    NETWORK_PACKET_CLASS_MEDIUM,
+    NETWORK_PACKET_CLASS_LARGE,
+    NETWORK_PACKET_CLASS_COUNT,
+};
+
+typedef struct {
+    List free_packets;
+    int free_count;
+    int reserve_count;
+
+    int size;
+    int header_size;
+} NetworkPacketPool;
+
+//--------------------------------------------------------------------------------------------------
+
+// All the state of one network interface. Nothing in the stack is global, so any number of these can
+// be used side by side.
+struct NetworkStack {
+    NetworkPacket network_packets[NETWORK_PACKET_COUNT];
+    NetworkPacketPool network_packet_pools[NETWORK_PACKET_CLASS_COUNT];
+
+    alignas(32) u8 small_packet_buffers[NETWORK_SMALL_PACKET_COUNT][NETWORK_PACKET_SMALL_SIZE];
+    alignas(32) u8 medium_packet_buffers[NETWORK_MEDIUM_PACKET_COUNT][NETWORK_PACKET_SIZE];
+    alignas(32) u8 large_packet_buffers[NETWORK_LARGE_PACKET_COUNT][NETWORK_PACKET_LARGE_SIZE];
+
+    Mac our_mac;
+    Ip our_ip;
+    Ip our_netmask;
+
+    Routing routing;
+    Ipv4 ipv4;
+    Igmp igmp;
+    Arp arp;
+    Udp udp;
+    Dhcp dhcp;
+    Filter filter;
+
+    // Owned by the network driver.
+    void* driver;
+
+    // Set by the driver if the hardware fills in the IP and UDP checksums of outgoing frames. The
+    // stack then leaves the UDP checksum field zero.
+    bool tx_checksum_offload;
+};
+
+#endif
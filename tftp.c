@@ -11,6 +11,9 @@
 #define TFTP_INITIAL_SERVER_PORT 69
 #define TFTP_CLIENT_PORT         23456
 
+// Opcode, filename and the "octet" and "blksize" options.
+#define TFTP_REQUEST_SIZE  (2 + TFTP_MAX_FILENAME_LENGTH + 1 + sizeof("octet") + sizeof("blksize") + sizeof("512"))
+
 //--------------------------------------------------------------------------------------------------
 
 enum {
@@ -48,7 +51,8 @@ typedef struct {
 
 //--------------------------------------------------------------------------------------------------
 
-void tftp_download_file(TftpConnection* connection, const char* filename, Ip server_ip) {
+void tftp_download_file(NetworkStack* stack, TftpConnection* connection, const char* filename, Ip server_ip) {
+    connection->stack = stack;
     connection->client_port = TFTP_CLIENT_PORT;
     connection->server_port = TFTP_INITIAL_SERVER_PORT;
 
@@ -56,7 +60,7 @@ void tftp_download_file(TftpConnection* connection, const char* filename, Ip ser
     connection->state = TFTP_STATE_REQUEST;
     connection->block_number = 0;
 
-    udp_listen(connection->client_port, 1);
+    udp_listen(stack, connection->client_port, 1);
     backoff_init(&connection->backoff, TFTP_BACKOFF_START_TIMEOUT, TFTP_BACKOFF_MAX_TIMEOUT, TFTP_BACKOFF_JITTER_FRACTION);
 
     for (int i = 0; i < TFTP_MAX_FILENAME_LENGTH && filename[i]; i++) {
@@ -85,7 +89,12 @@ void add_string_followed_by_zero(const char* string, u8** data) {
 //--------------------------------------------------------------------------------------------------
 
 void send_tftp_request(TftpConnection* connection) {
-    NetworkPacket* packet = allocate_network_packet();
+    NetworkPacket* packet = allocate_network_packet(connection->stack, TFTP_REQUEST_SIZE);
+
+    if (packet == 0) {
+        return;
+    }
+
     u8* data_start = (u8 *)&packet->data[packet->index];
     u8* data = data_start;
 
@@ -98,13 +107,21 @@ void send_tftp_request(TftpConnection* connection) {
     add_string_followed_by_zero("512", &data);
 
     packet->length = data - data_start;
-    udp_send_zero_copy(packet, connection->client_port, connection->server_port, connection->server_ip);
+
+    if (udp_send_zero_copy(connection->stack, packet, connection->client_port, connection->server_port, connection->server_ip) == false) {
+        free_network_packet(connection->stack, packet);
+    }
 }
 
 //--------------------------------------------------------------------------------------------------
 
 void ack_current_block(TftpConnection* connection) {
-    NetworkPacket* packet = allocate_network_packet();
+    NetworkPacket* packet = allocate_network_packet(connection->stack, 4);
+
+    if (packet == 0) {
+        return;
+    }
+
     u8* data = (u8 *)&packet->data[packet->index];
 
     write_be16(TFTP_OPCODE_ACK, data);
@@ -114,13 +131,27 @@ void ack_current_block(TftpConnection* connection) {
     data += 2;
 
     packet->length = 4;
-    udp_send_zero_copy(packet, connection->client_port, connection->server_port, connection->server_ip);
+
+    if (udp_send_zero_copy(connection->stack, packet, connection->client_port, connection->server_port, connection->server_ip) == false) {
+        free_network_packet(connection->stack, packet);
+    }
 }
 
 //--------------------------------------------------------------------------------------------------
 
 static void send_error_to(TftpConnection* connection, u16 dest_port, u16 error_code, const char* error_message) {
-    NetworkPacket* packet = allocate_network_packet();
+    int message_length = 0;
+
+    while (error_message[message_length]) {
+        message_length++;
+    }
+
+    NetworkPacket* packet = allocate_network_packet(connection->stack, 4 + message_length + 1);
+
+    if (packet == 0) {
+        return;
+    }
+
     u8* data_start = (u8 *)&packet->data[packet->index];
     u8* data = data_start;
 
@@ -133,7 +164,10 @@ static void send_error_to(TftpConnection* connection, u16 dest_port, u16 error_c
     add_string_followed_by_zero(error_message, &data);
 
     packet->length = data - data_start;
-    udp_send_zero_copy(packet, connection->client_port, dest_port, connection->server_ip);
+
+    if (udp_send_zero_copy(connection->stack, packet, connection->client_port, dest_port, connection->server_ip) == false) {
+        free_network_packet(connection->stack, packet);
+    }
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -160,7 +194,7 @@ bool compare_option(char** data, char* end, const char* string) {
 //--------------------------------------------------------------------------------------------------
 
 int try_read_oack(TftpConnection* connection) {
-    NetworkPacket* packet = udp_receive_zero_copy(connection->client_port);
+    NetworkPacket* packet = udp_receive_zero_copy(connection->stack, connection->client_port);
 
     if (packet == 0 || packet->length < 2) {
         return TFTP_STATUS_RETRY;
@@ -192,7 +226,7 @@ int try_read_oack(TftpConnection* connection) {
     connection->server_port = packet->source_port;
 
     return_and_delete:
-    free_network_packet(packet);
+    free_network_packet(connection->stack, packet);
     return status;
 }
 
@@ -200,7 +234,7 @@ int try_read_oack(TftpConnection* connection) {
 
 
 static int try_read_data(TftpConnection* connection, void* data, int size) {
-    NetworkPacket* packet = udp_receive_zero_copy(connection->client_port);
+    NetworkPacket* packet = udp_receive_zero_copy(connection->stack, connection->client_port);
     if (packet == 0) {
         return 0;
     }
@@ -227,7 +261,7 @@ static int try_read_data(TftpConnection* connection, void* data, int size) {
         bytes_written = size;
     }
 
-    free_network_packet(packet);
+    free_network_packet(connection->stack, packet);
     return bytes_written;
 }
 
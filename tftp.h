@@ -25,6 +25,7 @@ enum {
 //--------------------------------------------------------------------------------------------------
 
 typedef struct {
+    NetworkStack* stack;
     Ip server_ip;
 
     Port client_port;
@@ -41,7 +42,7 @@ typedef struct {
 
 //--------------------------------------------------------------------------------------------------
 
-void tftp_download_file(TftpConnection* connection, const char* filename, Ip server_ip);
+void tftp_download_file(NetworkStack* stack, TftpConnection* connection, const char* filename, Ip server_ip);
 void tftp_abort_download(TftpConnection* connection, const char* error_message);
 int tftp_read(TftpConnection* connection, void* buffer, int size);
 
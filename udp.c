@@ -2,11 +2,11 @@
 
 #include "udp.h"
 #include "list.h"
+#include "stack.h"
 #include "ip.h"
-
-//--------------------------------------------------------------------------------------------------
-
-#define UDP_CONNECTION_COUNT 16
+#include "mac.h"
+#include "gmac.h"
+#include "checksum.h"
 
 //--------------------------------------------------------------------------------------------------
 
@@ -17,106 +17,321 @@ typedef struct PACKED {
     u16   checksum;
 } UdpHeader;
 
+typedef struct PACKED {
+    MacHeader mac;
+    IpHeader  ip;
+    UdpHeader udp;
+} UdpFlowHeader;
+
 //--------------------------------------------------------------------------------------------------
 
-static UdpConnection connections[UDP_CONNECTION_COUNT];
-static List free_connections;
-static List used_connections;
+void udp_init(NetworkStack* stack) {
+    Udp* udp = &stack->udp;
 
-//--------------------------------------------------------------------------------------------------
+    list_init(&udp->free_connections);
 
-void udp_init() {
-    list_init(&free_connections);
-    list_init(&used_connections);
+    for (int i = 0; i < UDP_BUCKET_COUNT; i++) {
+        list_init(&udp->buckets[i]);
+    }
 
     for (int i = 0; i < UDP_CONNECTION_COUNT; i++) {
-        list_init(&connections[i].packet_queue);
-        list_add_first(&connections[i].list_node, &free_connections);
+        list_init(&udp->connections[i].packet_queue);
+        list_add_first(&udp->connections[i].list_node, &udp->free_connections);
     }
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static u16 compute_udp_checksum(NetworkPacket* packet, Ip senders_ip, Ip target_ip) {
+// Fibonacci hashing. Services often use ports which are multiples of some round number, so the low
+// bits alone would give many collisions.
+static List* get_bucket(NetworkStack* stack, Port port) {
+    u16 hash = (u16)(port * 40503u);
+    return &stack->udp.buckets[hash >> (16 - UDP_BUCKET_BITS)];
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// IPv4 psudo header without the length, which is the only field that changes between datagrams to
+// the same destination.
+static u32 sum_pseudo_header(Ip senders_ip, Ip target_ip) {
     u32 sum = 0;
 
-    // IPv4 psudo header. 
     sum += (senders_ip >> 16) & 0xFFFF;
     sum += (senders_ip >> 0) & 0xFFFF;
     sum += (target_ip >> 16) & 0xFFFF;
     sum += (target_ip >> 0) & 0xFFFF;
     sum += IP_PROTOCOL_UDP;
-    sum += packet->length;
 
-    // UDP header + UDP payload.
-    u16* pointer = (u16 *)&packet->data[packet->index];
-    u16 length = packet->length;
+    return sum;
+}
 
-    while (length > 1) {
-        sum += read_be16(pointer++);
-        length -= 2;
-    }
+//--------------------------------------------------------------------------------------------------
 
-    // Odd number of bytes in the payload.
-    if (length) {
-        sum += *(u8 *)pointer << 8;
-    }
+// The payload sum is passed in, since udp_send computes it while copying the data into the packet.
+static u16 compute_udp_checksum(UdpHeader* header, u32 pseudo_header_sum, int length, u32 payload_sum) {
+    u32 sum = pseudo_header_sum + length + payload_sum;
+    u16 checksum = checksum_finish(checksum_add(sum, header, sizeof(UdpHeader)));
 
-    while (sum >> 16) {
-        sum = (sum & 0xffff) + (sum >> 16);
-    }
+    // Zero means that no checksum was computed, so it is sent as all ones instead.
+    return (checksum) ? checksum : 0xFFFF;
+}
 
-    return (u16)~sum;
+//--------------------------------------------------------------------------------------------------
+
+// The hardware only fills in the checksum of datagrams sent in one frame. The stack computes it for
+// the ones which are sent as fragments. The length includes the UDP header.
+static bool needs_software_checksum(NetworkStack* stack, int length) {
+    return stack->tx_checksum_offload == false || length > IP_MAX_PAYLOAD_SIZE;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void udp_send_zero_copy(NetworkPacket* packet, Port source_port, Port dest_port, Ip ip) {
+static void push_udp_header(NetworkStack* stack, NetworkPacket* packet, u32 pseudo_header_sum, u32 payload_sum, Port source_port, Port dest_port) {
     packet->index -= sizeof(UdpHeader);
     packet->length += sizeof(UdpHeader);
 
     UdpHeader* header = (UdpHeader *)&packet->data[packet->index];
+    int length = get_network_packet_length(packet);
 
     write_be16(source_port, &header->source_port);
     write_be16(dest_port, &header->dest_port);
-    write_be16(packet->length, &header->length);
+    write_be16(length, &header->length);
     write_be16(0, &header->checksum);
-    write_be16(compute_udp_checksum(packet, get_our_ip(), ip), &header->checksum);
 
-    ip_send(packet, ip, IP_PROTOCOL_UDP);
+    if (needs_software_checksum(stack, length)) {
+        write_be16(compute_udp_checksum(header, pseudo_header_sum, length, payload_sum), &header->checksum);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void pop_udp_header(NetworkPacket* packet) {
+    packet->index += sizeof(UdpHeader);
+    packet->length -= sizeof(UdpHeader);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void udp_send(const void* data, int size, Port source_port, Port dest_port, Ip ip) {
-    NetworkPacket* packet = allocate_network_packet();
-    size = limit(size, NETWORK_PACKET_USER_SIZE);
+static bool send_udp_packet(NetworkStack* stack, NetworkPacket* packet, u32 payload_sum, Port source_port, Port dest_port, Ip ip) {
+    push_udp_header(stack, packet, sum_pseudo_header(get_our_ip(stack), ip), payload_sum, source_port, dest_port);
 
-    for (int i = 0; i < size; i++) {
-        packet->data[packet->index + i] = ((u8 *)data)[i];
+    if (ip_send(stack, packet, ip, IP_PROTOCOL_UDP) == false) {
+        pop_udp_header(packet);
+        return false;
     }
 
-    packet->length = size;
-    udp_send_zero_copy(packet, source_port, dest_port, ip);
+    return true;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void udp_listen(Port port, int max_packet_count) {
-    ListNode* node = list_remove_first(&free_connections);
-    UdpConnection* connection = get_struct_containing_list_node(node, UdpConnection, list_node);
+// Returns false if the packet could not be queued for transmission. The caller then still owns the
+// packet, with the UDP header removed again.
+bool udp_send_zero_copy(NetworkStack* stack, NetworkPacket* packet, Port source_port, Port dest_port, Ip ip) {
+    int length = get_network_packet_length(packet) + sizeof(UdpHeader);
+    u32 payload_sum = (needs_software_checksum(stack, length)) ? checksum_add_packet(0, packet) : 0;
+    return send_udp_packet(stack, packet, payload_sum, source_port, dest_port, ip);
+}
 
-    connection->max_packet_count = max_packet_count;
-    connection->port = port;
-    connection->packet_count = 0;
+//--------------------------------------------------------------------------------------------------
+
+// Copies the data into a new packet. The payload is summed while it is copied, so it is only read
+// once. Returns zero if there are not enough free packets, or the data does not fit in a datagram.
+static NetworkPacket* build_udp_packet(NetworkStack* stack, const void* data, int size, u32* payload_sum) {
+    if (size > UDP_MAX_PAYLOAD_SIZE) {
+        return 0;
+    }
+
+    NetworkPacket* packet = allocate_network_packet(stack, size);
+
+    // No single buffer is free that can hold the datagram. Build a chain of medium buffers instead.
+    if (packet == 0 && size > NETWORK_PACKET_USER_SIZE) {
+        packet = allocate_network_packet(stack, NETWORK_PACKET_USER_SIZE);
+    }
+
+    if (packet == 0) {
+        return 0;
+    }
+
+    bool appended;
+
+    if (needs_software_checksum(stack, size + sizeof(UdpHeader)) == false) {
+        appended = append_to_network_packet(stack, packet, data, size, false);
+    }
+    else {
+        appended = append_to_network_packet_with_checksum(stack, packet, data, size, payload_sum);
+    }
+
+    if (appended == false) {
+        free_network_packet(stack, packet);
+        return 0;
+    }
+
+    return packet;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns false if there is no free packet, the TX ring is full or the size is over
+// UDP_MAX_PAYLOAD_SIZE. The data is not sent in that case.
+bool udp_send(NetworkStack* stack, const void* data, int size, Port source_port, Port dest_port, Ip ip) {
+    u32 payload_sum = 0;
+    NetworkPacket* packet = build_udp_packet(stack, data, size, &payload_sum);
+
+    if (packet == 0) {
+        return false;
+    }
+
+    if (send_udp_packet(stack, packet, payload_sum, source_port, dest_port, ip) == false) {
+        free_network_packet(stack, packet);
+        return false;
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Sends datagrams which share ports and destination. Each packet holds the payload, as for
+// udp_send_zero_copy. The pseudo header and the address are only worked out once for the burst.
+// Returns the number of packets queued for transmission. The caller still owns the rest, with the
+// UDP header removed again.
+int udp_send_burst(NetworkStack* stack, NetworkPacket** packets, int count, Port source_port, Port dest_port, Ip ip) {
+    u32 pseudo_header_sum = sum_pseudo_header(get_our_ip(stack), ip);
+
+    for (int i = 0; i < count; i++) {
+        int length = get_network_packet_length(packets[i]) + sizeof(UdpHeader);
+        u32 payload_sum = (needs_software_checksum(stack, length)) ? checksum_add_packet(0, packets[i]) : 0;
+        push_udp_header(stack, packets[i], pseudo_header_sum, payload_sum, source_port, dest_port);
+    }
+
+    int sent = ip_send_burst(stack, packets, count, ip, IP_PROTOCOL_UDP);
+
+    for (int i = sent; i < count; i++) {
+        pop_udp_header(packets[i]);
+    }
+
+    return sent;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The flow is resolved on the first send, so the stack is not needed yet.
+void udp_connect(NetworkStack* stack, UdpFlow* flow, Port source_port, Port dest_port, Ip ip) {
+    (void)stack;
+    flow->ip = ip;
+    flow->source_port = source_port;
+    flow->dest_port = dest_port;
+    flow->valid = false;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns false if the MAC of the peer is not known yet.
+static bool update_flow(NetworkStack* stack, UdpFlow* flow) {
+    if (flow->valid && flow->arp_generation == stack->arp.generation && flow->route_generation == stack->routing.generation && flow->our_ip == get_our_ip(stack)) {
+        return true;
+    }
+
+    // Read the generations first, in case the lookup changes the tables.
+    flow->arp_generation = stack->arp.generation;
+    flow->route_generation = stack->routing.generation;
+    flow->our_ip = get_our_ip(stack);
+    flow->valid = ip_write_header_template(stack, flow->header_template, flow->ip, IP_PROTOCOL_UDP);
+
+    if (flow->valid == false) {
+        return false;
+    }
+
+    UdpFlowHeader* header = (UdpFlowHeader *)flow->header_template;
+
+    write_be16(flow->source_port, &header->udp.source_port);
+    write_be16(flow->dest_port, &header->udp.dest_port);
+    write_be16(0, &header->udp.length);
+    write_be16(0, &header->udp.checksum);
+
+    // The length, ID and checksum fields are zero in the template, so they add nothing here.
+    flow->ip_header_sum = checksum_add(0, &header->ip, sizeof(IpHeader));
+    flow->udp_header_sum = checksum_add(sum_pseudo_header(flow->our_ip, flow->ip), &header->udp, sizeof(UdpHeader));
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool send_on_flow(NetworkStack* stack, UdpFlow* flow, NetworkPacket* packet, u32 payload_sum) {
+    int udp_length = get_network_packet_length(packet) + sizeof(UdpHeader);
+    int ip_length = udp_length + sizeof(IpHeader);
+    u16 id = ip_next_id(stack);
+
+    packet->index -= UDP_FLOW_HEADER_SIZE;
+    packet->length += UDP_FLOW_HEADER_SIZE;
+
+    UdpFlowHeader* header = (UdpFlowHeader *)&packet->data[packet->index];
+    memory_copy(flow->header_template, header, UDP_FLOW_HEADER_SIZE);
+
+    write_be16(ip_length, &header->ip.length);
+    write_be16(id, &header->ip.id);
+    write_be16(udp_length, &header->udp.length);
+    write_be16(checksum_finish(flow->ip_header_sum + ip_length + id), &header->ip.checksum);
+
+    if (stack->tx_checksum_offload == false) {
+        u16 udp_checksum = checksum_finish(flow->udp_header_sum + 2 * udp_length + payload_sum);
+        write_be16((udp_checksum) ? udp_checksum : 0xFFFF, &header->udp.checksum);
+    }
+
+    if (gmac_send(stack, packet) == false) {
+        packet->index += UDP_FLOW_HEADER_SIZE;
+        packet->length -= UDP_FLOW_HEADER_SIZE;
+        return false;
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Same as udp_send_zero_copy. Until the peer is resolved, the packet takes the normal path through
+// the ARP layer.
+bool udp_flow_send_zero_copy(NetworkStack* stack, UdpFlow* flow, NetworkPacket* packet) {
+    // The template only covers datagrams sent in one frame.
+    bool fits = get_network_packet_length(packet) + sizeof(UdpHeader) <= IP_MAX_PAYLOAD_SIZE;
+
+    if (fits == false || update_flow(stack, flow) == false) {
+        return udp_send_zero_copy(stack, packet, flow->source_port, flow->dest_port, flow->ip);
+    }
+
+    u32 payload_sum = (stack->tx_checksum_offload) ? 0 : checksum_add_packet(0, packet);
+    return send_on_flow(stack, flow, packet, payload_sum);
+}
+
+//--------------------------------------------------------------------------------------------------
 
-    list_add_first(node, &used_connections);
+// Same as udp_send, with the payload summed while it is copied.
+bool udp_flow_send(NetworkStack* stack, UdpFlow* flow, const void* data, int size) {
+    if (size + sizeof(UdpHeader) > IP_MAX_PAYLOAD_SIZE || update_flow(stack, flow) == false) {
+        return udp_send(stack, data, size, flow->source_port, flow->dest_port, flow->ip);
+    }
+
+    u32 payload_sum = 0;
+    NetworkPacket* packet = build_udp_packet(stack, data, size, &payload_sum);
+
+    if (packet == 0) {
+        return false;
+    }
+
+    if (send_on_flow(stack, flow, packet, payload_sum) == false) {
+        free_network_packet(stack, packet);
+        return false;
+    }
+
+    return true;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static UdpConnection* find_connection(Port port) {
-    list_iterate(it, &used_connections) {
+static UdpConnection* find_connection(NetworkStack* stack, Port port) {
+    list_iterate(it, get_bucket(stack, port)) {
         UdpConnection* connection = get_struct_containing_list_node(it, UdpConnection, list_node);
         if (connection->port == port) {
             return connection;
@@ -128,8 +343,80 @@ static UdpConnection* find_connection(Port port) {
 
 //--------------------------------------------------------------------------------------------------
 
-NetworkPacket* udp_receive_zero_copy(Port port) {
-    UdpConnection* connection = find_connection(port);
+static UdpConnection* open_connection(NetworkStack* stack, Port port) {
+    UdpConnection* connection = find_connection(stack, port);
+
+    if (connection) {
+        return connection;
+    }
+
+    ListNode* node = list_remove_first(&stack->udp.free_connections);
+
+    if (node == 0) {
+        return 0;
+    }
+
+    connection = get_struct_containing_list_node(node, UdpConnection, list_node);
+
+    connection->port = port;
+    connection->packet_count = 0;
+
+    list_add_first(node, get_bucket(stack, port));
+    return connection;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+UdpConnection* udp_listen(NetworkStack* stack, Port port, int max_packet_count) {
+    UdpConnection* connection = open_connection(stack, port);
+
+    if (connection) {
+        connection->max_packet_count = max_packet_count;
+        connection->callback = 0;
+        connection->context = 0;
+    }
+
+    return connection;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Packets which were queued before the callback was set stay in the queue for udp_receive.
+UdpConnection* udp_listen_with_callback(NetworkStack* stack, Port port, UdpReceiveCallback callback, void* context) {
+    UdpConnection* connection = open_connection(stack, port);
+
+    if (connection) {
+        connection->max_packet_count = 0;
+        connection->callback = callback;
+        connection->context = context;
+    }
+
+    return connection;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void udp_close(NetworkStack* stack, Port port) {
+    UdpConnection* connection = find_connection(stack, port);
+
+    if (connection == 0) {
+        return;
+    }
+
+    while (connection->packet_count) {
+        ListNode* node = list_remove_first(&connection->packet_queue);
+        free_network_packet(stack, get_struct_containing_list_node(node, NetworkPacket, list_node));
+        connection->packet_count--;
+    }
+
+    list_remove(&connection->list_node);
+    list_add_first(&connection->list_node, &stack->udp.free_connections);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+NetworkPacket* udp_receive_zero_copy(NetworkStack* stack, Port port) {
+    UdpConnection* connection = find_connection(stack, port);
 
     if (connection == 0 || connection->packet_count == 0) {
         return 0;
@@ -144,42 +431,71 @@ NetworkPacket* udp_receive_zero_copy(Port port) {
 
 //--------------------------------------------------------------------------------------------------
 
-int udp_receive(void* data, int size, Port port) {
-    NetworkPacket* packet = udp_receive_zero_copy(port);
-    
-    if (packet == 0) {
+// Takes up to count queued packets from the port with a single lookup. Returns the number of packets
+// stored in packets. The caller frees them.
+int udp_receive_burst(NetworkStack* stack, NetworkPacket** packets, int count, Port port) {
+    UdpConnection* connection = find_connection(stack, port);
+
+    if (connection == 0) {
         return 0;
     }
 
-    size = limit(size, packet->length);
+    int received = 0;
+
+    for (; received < count && connection->packet_count; received++) {
+        ListNode* node = list_remove_first(&connection->packet_queue);
+        packets[received] = get_struct_containing_list_node(node, NetworkPacket, list_node);
+        connection->packet_count--;
+    }
+
+    return received;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int udp_receive(NetworkStack* stack, void* data, int size, Port port) {
+    NetworkPacket* packet = udp_receive_zero_copy(stack, port);
     
-    for (int i = 0; i < size; i++) {
-        ((u8 *)data)[i] = packet->data[packet->index + i];
+    if (packet == 0) {
+        return 0;
     }
 
-    free_network_packet(packet);
+    size = copy_from_network_packet(packet, 0, data, size);
+    free_network_packet(stack, packet);
     return size;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-void handle_udp(NetworkPacket* packet) {
+// Strips the UDP header. Returns the destination port, or -1 if the packet is too short or the
+// checksum is wrong. A zero checksum means the sender did not compute one.
+static int strip_udp_header(NetworkPacket* packet) {
     if (packet->length <= sizeof(UdpHeader)) {
-        free_network_packet(packet);
-        return;
+        return -1;
     }
 
     UdpHeader* header = (UdpHeader *)&packet->data[packet->index];
 
+    if ((packet->checksum_verified & NETWORK_CHECKSUM_UDP) == 0 && read_be16(&header->checksum)) {
+        u32 sum = sum_pseudo_header(packet->senders_ip, packet->target_ip) + get_network_packet_length(packet);
+
+        if (checksum_finish(checksum_add_packet(sum, packet)) != 0) {
+            return -1;
+        }
+    }
+
     packet->index += sizeof(UdpHeader);
     packet->length -= sizeof(UdpHeader);
-
-    Port dest_port = read_be16(&header->dest_port);
     packet->source_port = read_be16(&header->source_port);
 
-    UdpConnection* connection = find_connection(dest_port);
-    if (connection == 0) {
-        free_network_packet(packet);
+    return read_be16(&header->dest_port);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void deliver_packet(NetworkStack* stack, UdpConnection* connection, NetworkPacket* packet) {
+    if (connection->callback) {
+        connection->callback(stack, packet, connection->context);
         return;
     }
 
@@ -191,7 +507,57 @@ void handle_udp(NetworkPacket* packet) {
     if (connection->packet_count > connection->max_packet_count) {
         ListNode* node = list_remove_first(&connection->packet_queue);
         NetworkPacket* free_this = get_struct_containing_list_node(node, NetworkPacket, list_node);
-        free_network_packet(free_this);
+        free_network_packet(stack, free_this);
         connection->packet_count--;
     }
 }
+
+//--------------------------------------------------------------------------------------------------
+
+void handle_udp(NetworkStack* stack, NetworkPacket* packet) {
+    int dest_port = strip_udp_header(packet);
+    UdpConnection* connection = (dest_port < 0) ? 0 : find_connection(stack, dest_port);
+
+    if (connection == 0) {
+        free_network_packet(stack, packet);
+        return;
+    }
+
+    deliver_packet(stack, connection, packet);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Same as handle_udp for a burst of packets. Bursts tend to contain runs of packets to the same port,
+// so the last lookup is reused until the port changes.
+void handle_udp_burst(NetworkStack* stack, NetworkPacket** packets, int count) {
+    UdpConnection* connection = 0;
+    int last_port = -1;
+
+    for (int i = 0; i < count; i++) {
+        NetworkPacket* packet = packets[i];
+        int dest_port = strip_udp_header(packet);
+
+        if (dest_port < 0) {
+            free_network_packet(stack, packet);
+            continue;
+        }
+
+        if (dest_port != last_port) {
+            connection = find_connection(stack, dest_port);
+            last_port = dest_port;
+        }
+
+        if (connection == 0) {
+            free_network_packet(stack, packet);
+            continue;
+        }
+
+        // The callback may close the connection, so it is looked up again for the next packet.
+        if (connection->callback) {
+            last_port = -1;
+        }
+
+        deliver_packet(stack, connection, packet);
+    }
+}
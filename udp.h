@@ -5,27 +5,103 @@
 
 #include "utilities.h"
 #include "network.h"
+#include "list.h"
+#include "ip.h"
 
 //--------------------------------------------------------------------------------------------------
 
+#ifndef UDP_CONNECTION_COUNT
+#define UDP_CONNECTION_COUNT 64
+#endif
+
+// Size of the Ethernet, IPv4 and UDP headers in front of every datagram.
+#define UDP_FLOW_HEADER_SIZE  (14 + 20 + 8)
+
+// Connections are found through a hash of the port. Each bucket is a list of connections.
+#define UDP_BUCKET_BITS   6
+#define UDP_BUCKET_COUNT  (1 << UDP_BUCKET_BITS)
+
+// Largest payload of a datagram. Subtracts the IP and UDP headers. Datagrams which do not fit in one
+// frame are sent as IP fragments.
+#define UDP_MAX_PAYLOAD_SIZE  (IP_MAX_DATAGRAM_SIZE - 20 - 8)
+
+//--------------------------------------------------------------------------------------------------
+
+// Called from handle_udp for every datagram received on the port. The callback owns the packet and
+// must free it or send it on. The sender is in packet->senders_ip and packet->source_port.
+typedef void (*UdpReceiveCallback)(NetworkStack* stack, NetworkPacket* packet, void* context);
+
 typedef struct {
     Port port;
 
+    // Packets are queued for udp_receive if there is no callback.
+    UdpReceiveCallback callback;
+    void* context;
+
     List packet_queue;
     int packet_count;
     int max_packet_count;
 
+    // In the free list, or in the hash bucket of the port.
     ListNode list_node;
 } UdpConnection;
 
+// A connected flow to one peer. Once the MAC of the peer is known, the headers of the frames are
+// prebuilt in header_template along with the sums of their constant fields. A send then copies the
+// template and patches the lengths, the IP ID and the checksums. The ID comes from the same counter as
+// the rest of the datagrams we send.
+typedef struct {
+    Ip ip;
+    Port source_port;
+    Port dest_port;
+
+    // The template is rebuilt when the ARP table, the routing table or our IP has changed since it
+    // was built.
+    bool valid;
+    u32 arp_generation;
+    u32 route_generation;
+    Ip our_ip;
+
+    u32 ip_header_sum;
+    u32 udp_header_sum;
+    u8 header_template[UDP_FLOW_HEADER_SIZE];
+} UdpFlow;
+
+typedef struct {
+    UdpConnection connections[UDP_CONNECTION_COUNT];
+    List free_connections;
+    List buckets[UDP_BUCKET_COUNT];
+} Udp;
+
 //--------------------------------------------------------------------------------------------------
 
-void udp_init();
-void udp_send(const void* data, int size, Port source_port, Port dest_port, Ip ip);
-void udp_send_zero_copy(NetworkPacket* packet, Port source_port, Port dest_port, Ip ip);
-void udp_listen(Port port, int max_packet_count);
-int udp_receive(void* data, int size, Port port);
-NetworkPacket* udp_receive_zero_copy(Port port);
-void handle_udp(NetworkPacket* packet);
+void udp_init(NetworkStack* stack);
+bool udp_send(NetworkStack* stack, const void* data, int size, Port source_port, Port dest_port, Ip ip);
+bool udp_send_zero_copy(NetworkStack* stack, NetworkPacket* packet, Port source_port, Port dest_port, Ip ip);
+int udp_send_burst(NetworkStack* stack, NetworkPacket** packets, int count, Port source_port, Port dest_port, Ip ip);
+
+// Flows are owned by the caller. A flow does not listen on the source port.
+void udp_connect(NetworkStack* stack, UdpFlow* flow, Port source_port, Port dest_port, Ip ip);
+bool udp_flow_send(NetworkStack* stack, UdpFlow* flow, const void* data, int size);
+bool udp_flow_send_zero_copy(NetworkStack* stack, UdpFlow* flow, NetworkPacket* packet);
+
+// Returns the connection of the port, or zero if all connections are in use. Listening on a port
+// which is already open returns the existing connection with the new queue limit.
+UdpConnection* udp_listen(NetworkStack* stack, Port port, int max_packet_count);
+
+// Same as udp_listen, but datagrams are passed to the callback as soon as they arrive instead of
+// being queued.
+UdpConnection* udp_listen_with_callback(NetworkStack* stack, Port port, UdpReceiveCallback callback, void* context);
+
+// Frees all queued packets and makes the connection available again.
+void udp_close(NetworkStack* stack, Port port);
+int udp_receive(NetworkStack* stack, void* data, int size, Port port);
+
+// The packet may be a chain if the datagram did not fit in one buffer. See NetworkPacket.
+NetworkPacket* udp_receive_zero_copy(NetworkStack* stack, Port port);
+int udp_receive_burst(NetworkStack* stack, NetworkPacket** packets, int count, Port port);
+
+void handle_udp(NetworkStack* stack, NetworkPacket* packet);
+void handle_udp_burst(NetworkStack* stack, NetworkPacket** packets, int count);
 
 #endif